@@ -1,6 +1,6 @@
-//Huffman tables
+//default Huffman tables, copied in every decoder/encoder context
 //{prefix length, prefix, code = length of number that follows}
-int YDC[16][3]={
+static const int YDC[16][3]={
 {2,0b00,0},
 {3,0b010,1},
 {3,0b011,2},      
@@ -16,7 +16,7 @@ int YDC[16][3]={
 {-1,-1,-1},
 };
 
-int CDC[16][3]={
+static const int CDC[16][3]={
 {2,0b00,0},
 {2,0b01,1},
 {2,0b10,2},
@@ -34,7 +34,7 @@ int CDC[16][3]={
 
 //{prefix length, prefix, code}
 //code: [ZRL][#bit] ZRL={0..F} #bit={1..10}
-int YAC[256][3]={
+static const int YAC[256][3]={
 {2,0b00,0x01},
 {2,0b01,0x02},
 {3,0b100,0x03},
@@ -211,7 +211,7 @@ int YAC[256][3]={
 {-1,-1,-1},
 };
 
-int CAC[256][3]={
+static const int CAC[256][3]={
 //Codes of length 02 bits:
 {2,0b00,0x00},			//EOB
 {2,0b01,0x01},
@@ -392,7 +392,7 @@ int CAC[256][3]={
 };
 
 //standard set of Huffman tables
-uint8_t HT0[]={
+static uint8_t HT0[]={
 	0x00,0x00,0x01,0x05,0x01,0x01,0x01,0x01,0x01,0x01,0x00,0x00,0x00,0x00,0x00,0x00,
 	0x00,0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0A,0x0B,0x10,0x00,0x02,
 	0x01,0x03,0x03,0x02,0x04,0x03,0x05,0x05,0x04,0x04,0x00,0x00,0x01,0x7D,0x01,0x02,
@@ -422,13 +422,13 @@ uint8_t HT0[]={
 };
 
 //standard YDC Huffman table
-uint8_t HT1[]={
+static uint8_t HT1[]={
 	0x00,0x00,0x01,0x05,0x01,0x01,0x01,0x01,0x01,0x01,0x00,0x00,0x00,0x00,0x00,0x00,
 	0x00,0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0A,0x0B
 };
 
 //standard YAC Huffman table
-uint8_t HT2[]={
+static uint8_t HT2[]={
 	0x10,0x00,0x02,0x01,0x03,0x03,0x02,0x04,0x03,0x05,0x05,0x04,0x04,0x00,0x00,0x01,
 	0x7D,0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,
 	0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xA1,0x08,0x23,0x42,0xB1,0xC1,0x15,0x52,0xD1,
@@ -444,13 +444,13 @@ uint8_t HT2[]={
 };
 
 //standard CDC Huffman table
-uint8_t HT3[]={
+static uint8_t HT3[]={
 	0x01,0x00,0x03,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x01,0x00,0x00,0x00,0x00,
 	0x00,0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0A,0x0B
 };
 
 //standard CAC Huffman table
-uint8_t HT4[]={
+static uint8_t HT4[]={
 	0x11,0x00,0x02,0x01,0x02,0x04,0x04,0x03,0x04,0x07,0x05,0x04,0x04,0x00,0x01,0x02,
 	0x77,0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,
 	0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xA1,0xB1,0xC1,0x09,0x23,0x33,0x52,
@@ -24,7 +24,15 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "MCU.h"
+#include "jpeg-decomp.h"
 
 #define EOF_ERR 		-1000000
 #define EOI_MARKER 		-2000000
@@ -32,10 +40,7 @@
 #define RESTART_MARKER 	-4000000
 #define bufsize 128
 
-int Rbitcount=0;
-char MCUdef[32]="YYCC";		//default MCU composition
-int restartInt=-1;
-struct marker{ uint8_t type;
+static struct marker{ uint8_t type;
 				char size;	//0=no segment; 1=segment
 				char *shortname;
 				char *name;
@@ -105,86 +110,288 @@ struct marker{ uint8_t type;
 					{0xFE,1,"COM","Comment"},
 				}; 
 
-//read bit from file
-//file=0: reset bitcount
+//map whole file f in memory (read it where mmap is not available, or from a pipe)
+//return data pointer and size in *size, *mapped=0 if the data was read; 0 on error
+static uint8_t* mapfile(FILE* f,int* size,int* mapped){
+	uint8_t* p;
+	size_t n=0,k,sz=0x100000;
+	*mapped=0;
+#ifndef _WIN32
+	struct stat st;
+	if(fstat(fileno(f),&st)) return 0;
+	if(S_ISREG(st.st_mode)){
+		if(st.st_size==0) return 0;
+		*size=st.st_size;
+		p=mmap(0,*size,PROT_READ,MAP_PRIVATE,fileno(f),0);
+		if(p==MAP_FAILED) return 0;
+		madvise(p,*size,MADV_SEQUENTIAL);
+		*mapped=1;
+		return p;
+	}
+#endif
+	p=malloc(sz);
+	while(p&&(k=fread(p+n,1,sz-n,f))>0){
+		n+=k;
+		if(n==sz) p=realloc(p,sz*=2);
+	}
+	if(n==0){
+		free(p);
+		return 0;
+	}
+	*size=n;
+	return p;
+}
+
+//release data returned by mapfile
+static void unmapfile(uint8_t* p,int size,int mapped){
+#ifndef _WIN32
+	if(mapped){
+		munmap(p,size);
+		return;
+	}
+#endif
+	free(p);
+}
+
+//print a message to log (0: no messages)
+static void logPrintf(FILE* log,const char* fmt,...){
+	va_list ap;
+	if(!log) return;
+	va_start(ap,fmt);
+	vfprintf(log,fmt,ap);
+	va_end(ap);
+}
+
+//marker found in the input file
+struct markerseg{
+	int offset;			//position of 0xFF
+	int marker;			//byte after 0xFF (EOF at end of file)
+	int size;			//segment size (0: marker without segment)
+	union{				//parsed payload
+		struct{
+			int P,Y,X,comp;		//precision, lines, samples per line, components
+			int c;				//position of component parameters
+		} sof;
+		int interval;	//DRI restart interval
+		int table;		//DHT, DQT position of tables
+	};
+};
+
+//index of the markers found in the input file, built in one pass
+struct jpegindex{
+	struct markerseg* seg;
+	int nseg,segsize;
+	int sof0;			//last SOF0 marker (-1: none)
+	int dri;			//last DRI marker (-1: none)
+	int scanoffset;		//scan data start (after SOS segment)
+	int endoffset;		//EOI position (file size if missing)
+};
+
+//bit reader: bits are kept MSB first in a 64 bit accumulator, loaded from
+//a memory buffer holding the whole file
+//stuffed 0x00 bytes are removed while filling; a marker stops the filling
+//and is returned only when all the bits that precede it have been used
+struct decoder;
+struct bitreader{
+	const struct decoder* d;	//decoder using the reader
+	const uint8_t* buf;	//input data
+	int size;			//input size
+	int pos;			//next byte to load
+	uint64_t acc;		//bit accumulator
+	uint64_t stuff;		//1 on the last bit of every 0xFF byte followed by stuffing
+	int nbits;			//valid bits in acc
+	int marker;			//0=none; -1=EOF; 0xD0..0xD9 marker found at pos
+	int rst;			//1: restart markers are recognized
+	int16_t* coef;		//!=0: decodeBlock stores the 64 coefficients here (zigzag order, DC difference)
+};
+
+//load bytes in the accumulator until it holds at least 56 bits, 
+//unless a marker or EOF is found
+//bytes equal to 0xFF are checked one at a time, the rest is loaded 8 bytes at a time
+static void fillbits(struct bitreader* br){
+	int r,r2;
+	uint64_t w;
+	if(br->marker) return;
+	if(br->pos+8<=br->size){
+		memcpy(&w,br->buf+br->pos,8);
+		w=__builtin_bswap64(w);
+		if(((~w-0x0101010101010101ULL)&w&0x8080808080808080ULL)==0){	//no 0xFF bytes
+			int n=(63-br->nbits)>>3;		//bytes to load
+			br->acc|=w>>br->nbits;		//extra bits past n bytes are loaded again next time
+			br->acc&=~0ULL<<(64-br->nbits-n*8);
+			br->pos+=n;
+			br->nbits+=n*8;
+			return;
+		}
+	}
+	while(br->nbits<=56){
+		if(br->pos>=br->size){
+			br->marker=-1;
+			break;
+		}
+		r=br->buf[br->pos];
+		if(r==0xFF){	//bit stuffing or marker?
+			r2=br->pos+1<br->size?br->buf[br->pos+1]:-1;
+			if(r2==0xD9||(br->rst&&r2>=0xD0&&r2<=0xD7)){
+				br->marker=r2;
+				break;
+			}
+			br->stuff|=1ULL<<(63-br->nbits-7);	//increase bit count by 8 bit after this byte
+			br->pos++;		//remove bit stuffing
+		}
+		br->pos++;
+		br->acc|=(uint64_t)r<<(56-br->nbits);
+		br->nbits+=8;
+	}
+}
+
+//return next n bits (1<=n<=32) without removing them
+#define peekbits(br,n) ((int)((br)->acc>>(64-(n))))
+
+//remove n bits from accumulator
+static inline void skipbits(struct bitreader* br,int n){
+	br->acc<<=n;
+	br->stuff<<=n;
+	br->nbits-=n;
+}
+
+//bit address of the next bit in the file, as counted by the old bit by bit reader:
+//stuffing is counted after the last bit of 0xFF, markers after being returned
+static int64_t bitpos(struct bitreader* br){
+	return br->pos*8LL-br->nbits-8*__builtin_popcountll(br->stuff);
+}
+
+//start reading file data at bit address addr
+static void bitseek(struct bitreader* br,int64_t addr){
+	br->pos=addr>>3;
+	br->acc=br->stuff=0;
+	br->nbits=br->marker=0;
+	if(addr&7){
+		fillbits(br);
+		if(br->nbits>=(addr&7)) skipbits(br,addr&7);
+	}
+}
+
+//skip all valid bits and the marker that follows them
+//return value: same as getbit
+static int skipmarker(struct bitreader* br){
+	skipbits(br,br->nbits);
+	if(br->marker==-1) return -1;
+	int m=br->marker;
+	br->marker=0;
+	br->pos+=2;
+	if(m==0xD9) return -2;	//EOI
+	return -m;		//RESTART marker
+}
+
+//read bit from file data
 //return value:
 //0 	-> bit=0
 //1 	-> bit=1
-//-1	-> file=0 or EOF reached
+//-1	-> EOF reached
 //-2	-> EOI marker
 //-0xD0..-0xD9: -> RESTART marker #0..9
-int getbit(FILE* f){
-	static int numbit=0;
-	static int r=0;
-	static int bitstuffing=0;
-	int bit=0;
-	if(!f){
-		numbit=0;
-		bitstuffing=0;
-		return -1;
-	}
-	if(numbit==0){
-		r=fgetc(f);
-		if(r!=EOF){
-			if(r==0xFF){	//bit stuffing or marker?
-				int r2=fgetc(f);	//remove bit stuffing
-				if(r2==0xD9){
-					Rbitcount+=16;
-					return -2; //EOI
-				}
-				if(restartInt>=0&&r2>=0xD0&&r2<=0xD7){
-					Rbitcount+=16;
-					return -r2; //RESTART marker
-				}
-				bitstuffing=1;		//increase bit count by 8 bit on next byte
-			}
-		}
-		else return -1;
-	}
-	Rbitcount++;
-	bit=(r&0x80)?1:0;
-	r<<=1;
-	numbit++;
-	if(numbit==8){
-		numbit=0;
-		if(bitstuffing){	//increase offset when advancing next byte
-			Rbitcount+=8;
-			bitstuffing=0;
-		}
+static int getbit(struct bitreader* br){
+	int bit;
+	if(br->nbits==0){
+		fillbits(br);
+		if(br->nbits==0) return skipmarker(br);
 	}
+	bit=peekbits(br,1);
+	skipbits(br,1);
 	//printf("r%c",bit?'1':'0');
 	return bit;
 }
 
-//write bit to file
-//file=0:	reset bit count
-//bit=-1:	set remaining bits to 1 and force byte write
-void putbit(int bit,FILE* f){
-	static int numbit=0;
-	static int c=0;
-	if(!f){
-		numbit=0;
-		return;
+//bit writer: bits are collected MSB first in a 64 bit accumulator, then moved 
+//with bit stuffing to an output buffer that is written to file in large blocks
+//(or kept in memory when no file is given)
+#define WBUFSIZE 0x100000
+struct bitwriter{
+	uint64_t acc;		//bits to write
+	int nbits;			//valid bits in acc
+	uint8_t* buf;		//output buffer
+	size_t len;			//bytes in buf
+	size_t size;		//buffer size
+	FILE* f;			//output file (0: keep data in buf)
+};
+
+//start writing on file f (f=0: write to memory)
+static void writerInit(struct bitwriter* bw,FILE* f){
+	bw->acc=0;
+	bw->nbits=0;
+	bw->len=0;
+	bw->size=WBUFSIZE;
+	bw->buf=malloc(bw->size+16);
+	bw->f=f;
+}
+
+//write output buffer to file, or grow it when writing to memory
+static void flushbits(struct bitwriter* bw){
+	if(bw->f){
+		if(bw->len) fwrite(bw->buf,1,bw->len,bw->f);
+		bw->len=0;
 	}
-	//printf("w%c",bit?'1':'0');
-	if(bit==-1){
-		if(numbit!=0){	//force write
-			c<<=(8-numbit);
-			c|=(1<<(8-numbit))-1;	//fill with 1
-			numbit=8;
-		}
+	else if(bw->len>=bw->size){
+		bw->size*=2;
+		bw->buf=realloc(bw->buf,bw->size+16);
+	}
+}
+
+//free output buffer
+static void writerFree(struct bitwriter* bw){
+	free(bw->buf);
+	bw->buf=0;
+}
+
+//move complete bytes from accumulator to output buffer, adding bit stuffing
+//bytes are stored 8 at a time when none of them is 0xFF
+static inline void emitbytes(struct bitwriter* bw){
+	int n=bw->nbits>>3;
+	if(n==0) return;
+	if(bw->len>=bw->size) flushbits(bw);
+	uint64_t m=~0ULL<<(64-n*8);
+	if((((~bw->acc-0x0101010101010101ULL)&bw->acc&0x8080808080808080ULL)&m)==0){	//no 0xFF bytes
+		uint64_t w=__builtin_bswap64(bw->acc);
+		memcpy(bw->buf+bw->len,&w,8);
+		bw->len+=n;
 	}
 	else{
-		c<<=1;
-		c+=bit&1;
-		numbit++;
+		for(int i=0;i<n;i++){
+			uint8_t c=bw->acc>>(56-i*8);
+			bw->buf[bw->len++]=c;
+			if(c==0xFF) bw->buf[bw->len++]=0x00;	//add bit stuffing
+		}
 	}
-	if(numbit==8){
-		fputc(c,f);
-		if(c==0xFF) fputc(0x00,f);	//add bit stuffing
-		//printf("w%X ",c);
-		c=numbit=0;
+	bw->acc=n<8?bw->acc<<(n*8):0;
+	bw->nbits-=n*8;
+}
+
+//write n bits of x (n<=32)
+static inline void putbits(struct bitwriter* bw,uint32_t x,int n){
+	if(n<=0) return;
+	bw->acc|=(uint64_t)(x&(0xFFFFFFFFU>>(32-n)))<<(64-bw->nbits-n);
+	bw->nbits+=n;
+	if(bw->nbits>=32) emitbytes(bw);
+}
+
+//write bit
+//bit=-1:	set remaining bits to 1 and force byte write
+static void putbit(struct bitwriter* bw,int bit){
+	//printf("w%c",bit?'1':'0');
+	if(bit==-1){
+		if(bw->nbits&7) putbits(bw,0xFF,8-(bw->nbits&7));	//fill with 1
+		emitbytes(bw);	//force write
 	}
+	else putbits(bw,bit,1);
+}
+
+//write byte c as is (no bit stuffing);
+//bits that don't make a whole byte yet are kept for later
+static void putbyte(struct bitwriter* bw,int c){
+	emitbytes(bw);
+	if(bw->len>=bw->size) flushbits(bw);
+	bw->buf[bw->len++]=c;
 }
 
 //translate x expressed in n bits to integer according to
@@ -196,136 +403,554 @@ void putbit(int bit,FILE* f){
 //     3    | -7..-4,4..7
 //    ...        ...
 //    11    | -2047..-1024,1024..2047
-int decodeInt(int x, int n){
+static int decodeInt(int x, int n){
 		return x>=(1<<(n-1))?x:x-(1<<n)+1;
 }
 
-//encode x (DC value, max 11 bit) using Huffman table Htable
+//Huffman codes indexed by symbol, built from a {prefix length, prefix, code} table
+struct huffenc{
+	uint16_t code[256];
+	int8_t len[256];		//-1: symbol without code
+};
+
+//build h from table Htable: first prefix of each symbol, like a linear search
+//(rows left after the terminator by a shorter <dht> are found too)
+static void huffencInit(struct huffenc* h,int Htable[][3]){
+	memset(h->len,-1,sizeof(h->len));
+	for(int i=0;i<257;i++){
+		int s=Htable[i][2],n=Htable[i][0];
+		if(s>=0&&s<256&&n>=0&&n<=16&&h->len[s]==-1){
+			h->code[s]=Htable[i][1];
+			h->len[s]=n;
+		}
+	}
+}
+
+//encode x (DC value, max 11 bit) using Huffman codes h
 //result: 0xNNVVVVVV  (NN=total number of bits, VVVVVV=value)
-//-1 if x requires more than 11 bits
-int encodeH(int Htable[][3],int x){
+//-1 if x requires more than 11 bits or its size has no code
+static int encodeH(const struct huffenc* h,int x){
 	int val=x>0?x:-x;
-	int n,i;
+	int n;
 	for(n=0;val;val>>=1) n++;	//bits required
-	if(n>11) return -1;
-	for(i=0;Htable[i][2]!=n;i++);	//find prefix that encodes n bits
+	if(n>11||h->len[n]<0) return -1;
 	if(x<0) x+=(1<<n)-1;			//adjust for negative numbers
-	val=(Htable[i][1]<<Htable[i][2])+(x&((1<<n)-1)); //prefix + value
-	return (val&0xFFFFFF)+((Htable[i][0]+Htable[i][2])<<24);
+	val=(h->code[n]<<n)+(x&((1<<n)-1)); //prefix + value
+	return (val&0xFFFFFF)+((h->len[n]+n)<<24);
+}
+
+//Huffman lookup table, built from a [prefix length, prefix, code] table
+//codes up to HUFF_FASTBITS bits are found with a single lookup of the next bits,
+//longer codes are searched among the codes of the same length
+#define HUFF_FASTBITS 9
+struct huffLUT{
+	uint8_t fastlen[1<<HUFF_FASTBITS];	//code length (0 -> longer code or no code)
+	int fastsym[1<<HUFF_FASTBITS];		//code
+	int count[17];		//number of prefixes of each length
+	int valptr[17];		//index of first prefix of each length in prefix[]
+	int mincode[17];	//first and last prefix of each length
+	int maxcode[17];
+	int prefix[256];	//prefixes sorted by length and value
+	int sym[256];		//corresponding codes
+};
+
+//build lookup table from Huffman table Htable
+//matches exactly what a bit by bit search of Htable would find:
+//prefixes are tried from the shortest (2 bits) and, for each length,
+//only up to the first longer prefix in the table
+static void buildHuffLUT(int Htable[][3],struct huffLUT* h){
+	int i,j,k,n,x,np=0;
+	memset(h,0,sizeof(struct huffLUT));
+	for(n=2;n<=16;n++){
+		h->valptr[n]=np;
+		for(i=0;Htable[i][0]<=n;i++){
+			x=Htable[i][1];
+			if(Htable[i][0]==n&&x>=0&&x<(1<<n)&&np<256){
+				for(j=h->valptr[n];j<np&&h->prefix[j]<x;j++);
+				if(j<np&&h->prefix[j]==x) continue;	//duplicate: first one wins
+				for(k=np;k>j;k--){		//insert sorted
+					h->prefix[k]=h->prefix[k-1];
+					h->sym[k]=h->sym[k-1];
+				}
+				h->prefix[j]=x;
+				h->sym[j]=Htable[i][2];
+				np++;
+			}
+			if(x==-1) break;
+		}
+		h->count[n]=np-h->valptr[n];
+		if(h->count[n]){
+			h->mincode[n]=h->prefix[h->valptr[n]];
+			h->maxcode[n]=h->prefix[np-1];
+		}
+		if(n<=HUFF_FASTBITS){
+			for(j=h->valptr[n];j<np;j++){
+				x=h->prefix[j]<<(HUFF_FASTBITS-n);
+				for(k=0;k<1<<(HUFF_FASTBITS-n);k++){
+					if(h->fastlen[x+k]==0){		//shorter prefixes win
+						h->fastlen[x+k]=n;
+						h->fastsym[x+k]=h->sym[j];
+					}
+				}
+			}
+		}
+	}
+}
+
+
+//Huffman tables {prefix length, prefix, code}, each terminated by {-1,-1,-1}
+struct hufftables{
+	int YDC[257][3];
+	int YAC[257][3];
+	int CDC[257][3];
+	int CAC[257][3];
+};
+
+//set default tables (MCU.h)
+static void hufftablesInit(struct hufftables* ht){
+	memset(ht,0,sizeof(struct hufftables));
+	memcpy(ht->YDC,YDC,sizeof(YDC));
+	memcpy(ht->YAC,YAC,sizeof(YAC));
+	memcpy(ht->CDC,CDC,sizeof(CDC));
+	memcpy(ht->CAC,CAC,sizeof(CAC));
+}
+
+//decoder context: input file, its markers and the tables needed to decode it
+//while decoding the scan it is only read, so several threads can share it
+//(each one with its own bitreader)
+struct decoder{
+	const uint8_t* data;	//input file
+	int size;
+	struct jpegindex ix;	//markers
+	char MCUdef[32];		//MCU composition
+	int restartInt;			//restart interval (-1: no DRI)
+	struct hufftables ht;
+	struct huffLUT YDClut,YAClut,CDClut,CAClut;
+	FILE* log;				//messages (0: none)
+	int format;				//FORMAT_TEXT, FORMAT_BIN or FORMAT_ANALYZE output
+	FILE* heatmap;			//FORMAT_ANALYZE heatmap (0: none)
+	int verify;				//FORMAT_VERIFY result (VERIFY_xxx)
+	int64_t verifypos;		//and its bit address
+	uint8_t* scan;			//FORMAT_DIFF: copy of the scan data (FORMAT_SPLICE: of the whole file)
+	int scansize,scanstart;
+	int64_t* mcupos;		//FORMAT_DIFF: bit address of every MCU, relative to the scan, and of the end
+	int nmcu,Mx;
+	FILE* index;			//index written while decoding (0: none)
+	int indexstep;
+	FILE* indexin;			//index used to decode the MCU range (0: none)
+	int mcufirst,mculast;	//MCU range (mculast<0: all)
+	int sofmcu;				//MCUs of the SOF0 frame of the last image (-1: no SOF0)
+	int rx,ry,rw,rh;		//region of interest (rw>0), in MCU or pixels
+	int regionpx;			//1: region in pixels
+};
+#define FORMAT_VERIFY 3		//decodeJpeg for verifyJpeg
+#define FORMAT_DIFF 4		//decodeJpeg for diffJpeg
+#define FORMAT_SPLICE 5		//decodeJpeg for the base file of encodeJpeg
+
+struct decoder* decoderNew(){
+	struct decoder* d=calloc(1,sizeof(struct decoder));
+	if(!d) return 0;
+	strcpy(d->MCUdef,"YYCC");	//default MCU composition
+	d->restartInt=-1;
+	hufftablesInit(&d->ht);
+	d->log=stdout;
+	d->mculast=-1;
+	return d;
+}
+
+void decoderLog(struct decoder* d,FILE* log){
+	d->log=log;
+}
+
+void decoderFormat(struct decoder* d,int format){
+	d->format=format;
+}
+
+void decoderHeatmap(struct decoder* d,FILE* pgm){
+	d->heatmap=pgm;
+}
+
+void decoderIndex(struct decoder* d,FILE* idx,int step){
+	d->index=idx;
+	d->indexstep=step;
+}
+
+void decoderRange(struct decoder* d,int first,int last,FILE* idx){
+	d->mcufirst=first;
+	d->mculast=last;
+	d->indexin=idx;
+}
+
+void decoderRegion(struct decoder* d,int x,int y,int w,int h,int pixels,FILE* idx){
+	d->rx=x;
+	d->ry=y;
+	d->rw=w;
+	d->rh=h;
+	d->regionpx=pixels;
+	d->indexin=idx;
+}
+
+void decoderFree(struct decoder* d){
+	if(!d) return;
+	free(d->ix.seg);
+	free(d->scan);
+	free(d->mcupos);
+	free(d);
+}
+
+//build lookup tables of all Huffman tables
+static void buildHuffLUTs(struct decoder* d){
+	buildHuffLUT(d->ht.YDC,&d->YDClut);
+	buildHuffLUT(d->ht.YAC,&d->YAClut);
+	buildHuffLUT(d->ht.CDC,&d->CDClut);
+	buildHuffLUT(d->ht.CAC,&d->CAClut);
+}
+
+//start a bit reader on the input of decoder d
+static void readerInit(struct bitreader* br,const struct decoder* d){
+	memset(br,0,sizeof(struct bitreader));
+	br->d=d;
+	br->buf=d->data;
+	br->size=d->size;
+	br->rst=d->restartInt>=0;
+}
+
+//byte at position p of data, EOF if past the end
+#define getbyte(data,size,p) ((p)<(size)?(int)(data)[p]:EOF)
+
+//scan decoder input for markers, print them and fill the decoder index
+//markers and skipped segments are counted the same way in the scan data, so
+//restart markers are listed too (printed only without restart interval)
+static void indexJpeg(struct decoder* d){
+	const uint8_t* data=d->data;
+	int size=d->size;
+	struct jpegindex* ix=&d->ix;
+	int p,i=0,j,r2,len=0;
+	const uint8_t* q;
+	free(ix->seg);
+	memset(ix,0,sizeof(struct jpegindex));
+	ix->sof0=ix->dri=-1;
+	ix->segsize=64;
+	ix->seg=malloc(ix->segsize*sizeof(struct markerseg));
+	logPrintf(d->log,"Addr     \tMarker\tType\n");
+	for(p=0;p<size&&(q=memchr(data+p,0xFF,size-p));i+=2){
+		i+=q-data-p;
+		p=q-data+1;
+		r2=getbyte(data,size,p);
+		if(p<size) p++;
+		if(r2==0) continue;		//bit stuffing
+		if(ix->nseg==ix->segsize){
+			ix->segsize*=2;
+			ix->seg=realloc(ix->seg,ix->segsize*sizeof(struct markerseg));
+		}
+		struct markerseg* m=ix->seg+ix->nseg++;
+		memset(m,0,sizeof(struct markerseg));
+		m->offset=i;
+		m->marker=r2;
+		if(d->restartInt==-1||(d->restartInt==0&&!(r2>=0xD0&&r2<=0xD7))) logPrintf(d->log,"@0x%04X \t0xFF%02X\t",i,r2);	//no RSTX
+		for(j=0;j<sizeof(markers)/sizeof(struct marker);j++){
+			if(r2==markers[j].type){
+				if(markers[j].size==1){
+					len=(getbyte(data,size,p)<<8)+getbyte(data,size,p+1);
+					p+=2;
+					logPrintf(d->log,"%s (%d bytes)\n",markers[j].shortname,len);
+					if(len>=2&&p+len-2<size) p+=len-2;
+					else if(len!=2) p=size;
+					i+=len;
+					m->size=len;
+				}
+				else if(d->restartInt==-1||(d->restartInt==0&&!(r2>=0xD0&&r2<=0xD7))) logPrintf(d->log,"%s\n",markers[j].shortname);	//no RSTX
+				if(r2==0xDA) ix->scanoffset=i+2;	//SOS -> start of stream
+				if(r2==0xD9) ix->endoffset=i;		//EOI -> end of image
+				if(r2==0xDD&&len==4){				//DRI define restart interval
+					m->interval=(getbyte(data,size,i)<<8)+getbyte(data,size,i+1);
+					ix->dri=ix->nseg-1;
+					d->restartInt=0;
+				}
+				if(r2==0xC0){						//SOF0 P
+					int s=i-len+4;
+					m->sof.P=getbyte(data,size,s);
+					m->sof.Y=(getbyte(data,size,s+1)<<8)+getbyte(data,size,s+2);
+					m->sof.X=(getbyte(data,size,s+3)<<8)+getbyte(data,size,s+4);
+					m->sof.comp=getbyte(data,size,s+5);
+					m->sof.c=s+6;
+					ix->sof0=ix->nseg-1;
+				}
+				if(r2==0xC4) m->table=i-len+4;		//DHT "Define Huffman Table"
+				if(r2==0xDB) m->table=i-len+4;		//DQT "Define Quantization Table"
+				break;
+			}
+		}
+		if(j==sizeof(markers)/sizeof(struct marker)) logPrintf(d->log,"??\n");
+	}
+	if(ix->endoffset==0) ix->endoffset=size;
+}
+
+
+//search prefix x of length n
+//return index in prefix[] or -1
+static int huffSearch(const struct huffLUT* h,int n,int x){
+	int lo,hi,m;
+	if(h->count[n]==0||x<h->mincode[n]||x>h->maxcode[n]) return -1;
+	if(h->maxcode[n]-h->mincode[n]+1==h->count[n]) return h->valptr[n]+x-h->mincode[n];	//consecutive codes
+	for(lo=h->valptr[n],hi=lo+h->count[n]-1;lo<=hi;){
+		m=(lo+hi)/2;
+		if(h->prefix[m]==x) return m;
+		if(h->prefix[m]<x) lo=m+1;
+		else hi=m-1;
+	}
+	return -1;
+}
+
+//convert getbit return value to decodeHval error code
+static int streamerr(int bit){
+	if(bit==-1) return EOF_ERR;
+	else if(bit==-2) return EOI_MARKER;	//EOI marker
+	return RESTART_MARKER+bit;		//RESTART marker
+}
+
+//find Huffman code at current position; bits are not removed
+//at least 32 bits (code + value) are made available, unless the stream ends
+//limit: number of bits read before giving up
+//return value:
+//code (>=0), with prefix length in *len
+//HTAB_ERR 			-> can't find a code
+//EOF_ERR,EOI_MARKER,RESTART_MARKER-(0xD0..0xD7) -> stream ends before a code is found; bits and marker are skipped
+static int huffCode(struct bitreader* br,const struct huffLUT* h,int limit,int* len){
+	int n,x,i;
+	if(br->nbits<32) fillbits(br);
+	x=peekbits(br,HUFF_FASTBITS);
+	n=h->fastlen[x];
+	if(n&&n<=br->nbits){
+		*len=n;
+		return h->fastsym[x];
+	}
+	if(n==0&&br->nbits>HUFF_FASTBITS){	//longer code
+		for(n=HUFF_FASTBITS+1;n<=16&&n<=br->nbits;n++){
+			i=huffSearch(h,n,peekbits(br,n));
+			if(i>=0){
+				*len=n;
+				return h->sym[i];
+			}
+		}
+	}
+	if(br->nbits>=limit) return HTAB_ERR;
+	return streamerr(skipmarker(br));
 }
 
-//decode DC value from file f using Huffman table Htable
-//if f2!=0 write encoded value to f2 
+//decode DC value from file data using Huffman lookup table h
+//if bw!=0 write encoded value with bit writer bw
 //return value:
 //EOF_ERR 			-> end of file
 //EOI_MARKER 		-> EOI marker
 //RESTART_MARKER-(0xD0..0xD7) -> restart marker
-//HTAB_ERR 			-> can't find a coefficient; file bit index back to starting point
+//HTAB_ERR 			-> can't find a coefficient; bit index unchanged
 //[-2047..2047] 	-> DC value correctly decoded
-int decodeHvalDC(int Htable[][3],FILE *f,FILE *f2){
-	int startAddr=Rbitcount;
-	int bit,h,i,j,x,y;
-	bit=getbit(f); //printf("%d %X\n",Rbitcount,Rbitcount/8);
-	if(bit==-1) return EOF_ERR;
-	else if(bit==-2) return EOI_MARKER;	//EOI marker
-	else if(bit<-2) return RESTART_MARKER+bit;	//RESTART marker
-	x=bit;
-	for(int n=1;n<16;){	//max 16 bit
-		bit=getbit(f);
-		if(bit==-1) return EOF_ERR;
-		else if(bit==-2) return EOI_MARKER;	//EOI marker
-		else if(bit<-2) return RESTART_MARKER+bit;	//RESTART marker
-		x=(x<<1)+bit;	//printf("%d %X\n",Rbitcount,Rbitcount/8);
-		h=0;
-		n++;
-		for(i=0;Htable[i][0]<=n&&h!=-1;i++){
-			h=Htable[i][1];		//prefix
-			if(n==Htable[i][0]&&x==h){ 	//right prefix
-				if(f2) for(j=1<<(n-1);j;j>>=1) putbit(x&j?1:0,f2);
-				if(Htable[i][2]==0) return 0;	//0 bit prefix
-				y=0;
-				for(j=Htable[i][2];j;j--){	//value on j bits
-					bit=getbit(f);
-					if(bit==-1) return EOF_ERR;
-					else if(bit==-2) return EOI_MARKER;	//EOI marker
-					else if(bit<-2) return RESTART_MARKER+bit;	//RESTART marker
-					y<<=1;
-					y+=bit;
-				}
-				if(f2) for(j=1<<(Htable[i][2]-1);j;j>>=1) putbit(y&j?1:0,f2);
-				//printf("DC: %X.%X(%d) #bit:%d+%d = %d\n",h,y,y,Htable[i][0],Htable[i][2],decodeInt(y,Htable[i][2]));
-				return decodeInt(y,Htable[i][2]);
-			}
-		}
+static int decodeHvalDC(struct bitreader* br,const struct huffLUT* h,struct bitwriter* bw){
+	int n,s,x,y;
+	s=huffCode(br,h,16,&n);	//max 16 bit
+	if(s<0) return s;
+	if(s==0){		//0 bit value
+		if(bw) putbits(bw,peekbits(br,n),n);
+		skipbits(br,n);
+		return 0;
 	}
-	int addr0=startAddr/8;
-	fseek(f,addr0,0);
-	Rbitcount=addr0*8;
-	getbit(0);	//reset bitcount
-	for(;Rbitcount<startAddr;getbit(f));	//back to start	
-	return HTAB_ERR;
+	if(br->nbits<n+s){
+		if(bw) putbits(bw,peekbits(br,n),n);
+		return streamerr(skipmarker(br));
+	}
+	x=peekbits(br,n+s);	//prefix + value
+	skipbits(br,n+s);
+	if(bw) putbits(bw,x,n+s);
+	y=x&((1<<s)-1);
+	//printf("DC: %X.%X(%d) #bit:%d+%d = %d\n",x>>s,y,y,n,s,decodeInt(y,s));
+	return decodeInt(y,s);
 }
 
 #define EOB 0x1000000
 #define ZRL 0x2000000
-//decode AC value from file f using Huffman table Htable
-//if f2!=0 write encoded value to f2 
+//decode AC value from file data using Huffman lookup table h
+//if bw!=0 write encoded value with bit writer bw
 //return value:
 //EOF_ERR 			-> end of file
 //EOI_MARKER 		-> EOI marker
 //RESTART_MARKER-(0xD0..0xD7) -> restart marker
-//HTAB_ERR 			-> can't find a coefficient; file bit index back to starting point
+//HTAB_ERR 			-> can't find a coefficient; bit index unchanged
 //EOB 				-> end of block
 //ZRL 				-> zero run length = 16 zeros
 //AC coefficient	-> format: 0xZZXXXX
 //		XXXX = coefficient
 //		ZZ = number of zeros preceding the coefficient
-int decodeHvalAC(int Htable[][3],FILE *f,FILE *f2){
-	int startAddr=Rbitcount;
-	int bit,h,i,j,x,y,nz;
-	bit=getbit(f);
-	if(bit==-1) return EOF_ERR;
-	else if(bit==-2) return EOI_MARKER;	//EOI marker
-	else if(bit<-2) return RESTART_MARKER+bit;	//RESTART marker
-	x=bit;
-	for(int n=1;n<17;){	//max 16 bit
-		bit=getbit(f);
-		if(bit==-1) return EOF_ERR;
-		else if(bit==-2) return EOI_MARKER;	//EOI marker
-		else if(bit<-2) return RESTART_MARKER+bit;	//RESTART marker
-		x=(x<<1)+bit;
-		h=0;
-		n++;
-		for(i=0;Htable[i][0]<=n&&h!=-1;i++){
-			h=Htable[i][1];
-			if(n==Htable[i][0]&&x==h){
-				if(f2) for(j=1<<(n-1);j;j>>=1) putbit(x&j?1:0,f2);
-				if(Htable[i][2]==0) return EOB; 
-				if(Htable[i][2]==0xF0) return ZRL; //Zero run length = 16 zeros
-				//code format: [# zeros][# bit]
-				y=0;
-				nz=Htable[i][2]>>4;
-				for(j=Htable[i][2]&0xF;j;j--){
-					bit=getbit(f);
-					if(bit==-1) return EOF_ERR;
-					else if(bit==-2) return EOI_MARKER;	//EOI marker
-					else if(bit<-2) return RESTART_MARKER+bit;	//RESTART marker
-					y<<=1;
-					y+=bit;
-				}
-				if(f2) for(j=1<<((Htable[i][2]&0xF)-1);j;j>>=1) putbit(y&j?1:0,f2);
-				y=decodeInt(y,Htable[i][2]&0xF);
-				//printf("Z%d N%d\n",nz,y);
-				return (nz<<16)+(y&0xFFFF);	//0xZZXXXX
-			}
+static int decodeHvalAC(struct bitreader* br,const struct huffLUT* h,struct bitwriter* bw){
+	int n,s,x,y,nz;
+	s=huffCode(br,h,17,&n);	//max 16 bit
+	if(s<0) return s;
+	if(s==0||s==0xF0||(s&0xF)==0){
+		if(bw) putbits(bw,peekbits(br,n),n);
+		skipbits(br,n);
+		if(s==0) return EOB;
+		if(s==0xF0) return ZRL; //Zero run length = 16 zeros
+		return (s>>4)<<16;
+	}
+	//code format: [# zeros][# bit]
+	nz=s>>4;
+	s&=0xF;
+	if(br->nbits<n+s){
+		if(bw) putbits(bw,peekbits(br,n),n);
+		return streamerr(skipmarker(br));
+	}
+	x=peekbits(br,n+s);	//prefix + value
+	skipbits(br,n+s);
+	if(bw) putbits(bw,x,n+s);
+	y=decodeInt(x&((1<<s)-1),s);
+	//printf("Z%d N%d\n",nz,y);
+	return (nz<<16)+(y&0xFFFF);	//0xZZXXXX
+}
+
+//text output: characters are collected in a large buffer which is written 
+//to file f when full; with f=0 the buffer grows in memory
+#define TBUFSIZE 0x100000
+struct textbuf{
+	char* buf;
+	size_t len;			//characters in buf
+	size_t size;		//buffer size
+	FILE* f;
+};
+static char bitchars[256][8];	//'0'/'1' expansion of every byte
+static char hexchars[256][2];	//hex expansion of every byte
+static pthread_once_t textcharsOnce=PTHREAD_ONCE_INIT;
+
+static void textcharsInit(){
+	for(int i=0;i<256;i++){
+		for(int j=0;j<8;j++) bitchars[i][j]='0'+((i>>(7-j))&1);
+		hexchars[i][0]="0123456789ABCDEF"[i>>4];
+		hexchars[i][1]="0123456789ABCDEF"[i&0xF];
+	}
+}
+
+//init text buffer t, writing to file f (0=memory only)
+static void textInit(struct textbuf* t,FILE* f){
+	t->f=f;
+	t->len=0;
+	t->size=f?TBUFSIZE:TBUFSIZE/16;
+	t->buf=malloc(t->size);
+	pthread_once(&textcharsOnce,textcharsInit);
+}
+
+//write buffer to file (if any)
+static void textFlush(struct textbuf* t){
+	if(t->f&&t->len){
+		fwrite(t->buf,1,t->len,t->f);
+		t->len=0;
+	}
+}
+
+static void textFree(struct textbuf* t){
+	textFlush(t);
+	free(t->buf);
+	t->buf=0;
+	t->len=t->size=0;
+}
+
+//make room for n more characters
+static inline void textReserve(struct textbuf* t,size_t n){
+	if(t->len+n<=t->size) return;
+	textFlush(t);
+	if(t->len+n>t->size){
+		while(t->len+n>t->size) t->size*=2;
+		t->buf=realloc(t->buf,t->size);
+	}
+}
+
+static inline void textPutc(struct textbuf* t,char c){
+	textReserve(t,1);
+	t->buf[t->len++]=c;
+}
+
+static void textWrite(struct textbuf* t,const char* str,size_t n){
+	textReserve(t,n);
+	memcpy(t->buf+t->len,str,n);
+	t->len+=n;
+}
+
+static void textPuts(struct textbuf* t,const char* str){
+	size_t n=strlen(str);
+	textReserve(t,n);
+	memcpy(t->buf+t->len,str,n);
+	t->len+=n;
+}
+
+//write decimal integer
+static inline void textPutInt(struct textbuf* t,int x){
+	char str[12];
+	int n=0;
+	unsigned u=x<0?-(unsigned)x:x;
+	textReserve(t,12);
+	do{
+		str[n++]='0'+u%10;
+		u/=10;
+	}while(u);
+	if(x<0) t->buf[t->len++]='-';
+	while(n) t->buf[t->len++]=str[--n];
+}
+
+//write hex integer (as %X)
+static inline void textPutX(struct textbuf* t,unsigned x){
+	char str[8];
+	int n=0;
+	textReserve(t,8);
+	do{
+		str[n++]="0123456789ABCDEF"[x&0xF];
+		x>>=4;
+	}while(x);
+	while(n) t->buf[t->len++]=str[--n];
+}
+
+static void textPrintf(struct textbuf* t,const char* fmt,...){
+	va_list ap;
+	int n;
+	textReserve(t,256);
+	va_start(ap,fmt);
+	n=vsnprintf(t->buf+t->len,t->size-t->len,fmt,ap);
+	va_end(ap);
+	if(n>=t->size-t->len){		//didn't fit
+		textReserve(t,n+1);
+		va_start(ap,fmt);
+		vsnprintf(t->buf+t->len,t->size-t->len,fmt,ap);
+		va_end(ap);
+	}
+	t->len+=n;
+}
+
+//write bytes as hex digits (2 per byte)
+static void textPutHex(struct textbuf* t,const uint8_t* data,int n){
+	textReserve(t,n*2);
+	for(int i=0;i<n;i++){
+		memcpy(t->buf+t->len,hexchars[data[i]],2);
+		t->len+=2;
+	}
+}
+
+//write bits of file data from bit address start to end as '0'/'1' characters,
+//a whole byte at a time; the byte following 0xFF (bit stuffing) is skipped, as done by the bit reader
+static void textPutBits(struct textbuf* t,const uint8_t* buf,int64_t start,int64_t end){
+	int c,b;
+	char* p;
+	if(end<=start) return;
+	textReserve(t,end-start+8);
+	p=t->buf+t->len;
+	for(int64_t a=start;a<end;){
+		c=buf[a>>3];
+		b=a&7;
+		if(b==0&&end-a>=8){
+			memcpy(p,bitchars[c],8);
+			p+=8;
+			a+=8;
 		}
+		else for(;b<8&&a<end;b++,a++) *p++=bitchars[c][b];
+		if((a&7)==0&&c==0xFF) a+=8;	//skip stuffing
 	}
-	int addr0=startAddr/8;
-	fseek(f,addr0,0);
-	Rbitcount=addr0*8;
-	getbit(0);	//reset bitcount
-	for(;Rbitcount<startAddr;getbit(f));	//back to start	
-	return HTAB_ERR;
+	t->len=p-t->buf;
 }
 
 #define Y_BLOCK 0
@@ -336,43 +961,188 @@ int decodeHvalAC(int Htable[][3],FILE *f,FILE *f2){
 #define DECODE_EOI 2
 #define DECODE_RESTART 3
 #define DECODE_PARTIAL_RESTART 4
+#define DECODE_TOOMANY 0x10	//added to DECODE_OK: more than 63 AC coefficients
+//write block start "<y>\n//[Y@0xAAA.B]" or "<c>\n//[C@0xAAA.B]"
+static void textBlockHead(struct textbuf* t,int type,int64_t addr){
+	textPuts(t,type==0?"\n<y>\n//[Y@0x":"\n<c>\n//[C@0x");
+	textPutX(t,addr>>3);
+	textPutc(t,'.');
+	textPutc(t,'0'+(addr&7));
+	textPutc(t,']');
+}
+
+//binary coefficient container (-format bin), numbers are little endian
+//header:		"JDCB", u16 version, u16 header size, u32 segments, u32 blocks,
+//				u64 segment table offset, u64 block table offset
+//records, in stream order from the end of the header:
+//	BIN_RAW u32 n, n bytes						data copied as is
+//	BIN_DHT u8 table, u16 n, n x 3 i32			Huffman table 0-3 (YDC YAC CDC CAC) as [length prefix code]
+//	BIN_RESTART u8 n							restart marker n
+//	BIN_Y/BIN_C i32 DC, u16 n, (n+7)/8 bytes	block: DC and n bits of AC data (no bit stuffing)
+//segment table, 16 bytes per record (a run of blocks is a single BIN_BLOCKS segment):
+//	u8 type, u8 table or restart #, u16 0, u32 bytes/table entries/blocks, u64 offset of the record
+//block table: u64 offset of every block record
+#define BIN_VERSION 1
+#define BIN_HEADSIZE 32
+#define BIN_RAW 1
+#define BIN_DHT 2
+#define BIN_RESTART 3
+#define BIN_BLOCKS 4
+#define BIN_Y 5
+#define BIN_C 6
+
+static inline void binSet(uint8_t* p,uint64_t x,int n){
+	for(;n;n--,x>>=8) *p++=x;
+}
+
+static inline uint64_t binGet(const uint8_t* p,int n){
+	uint64_t x=0;
+	while(n) x=(x<<8)|p[--n];
+	return x;
+}
+
+//write n bytes of x
+static inline void binPut(struct textbuf* t,uint64_t x,int n){
+	textReserve(t,n);
+	binSet((uint8_t*)t->buf+t->len,x,n);
+	t->len+=n;
+}
+
+//length of the record at p, 0 if unknown
+//at least 7 bytes must be readable
+static size_t binRecordLen(const uint8_t* p){
+	if(p[0]==BIN_RAW) return 5+binGet(p+1,4);
+	if(p[0]==BIN_DHT) return 4+12*binGet(p+2,2);
+	if(p[0]==BIN_RESTART) return 2;
+	if(p[0]==BIN_Y||p[0]==BIN_C) return 7+(binGet(p+5,2)+7)/8;
+	return 0;
+}
+
+//write block record with the AC bits from start to end of buf, removing bit stuffing
+static void binPutBlock(struct textbuf* t,int type,int dc,const uint8_t* buf,int64_t start,int64_t end){
+	uint32_t acc=0;
+	int n=0,nbits=0;
+	binPut(t,type==0?BIN_Y:BIN_C,1);
+	binPut(t,dc,4);
+	size_t o=t->len;
+	textReserve(t,2+(end-start)/8+1);
+	t->len+=2;
+	uint8_t* q=(uint8_t*)t->buf+t->len;
+	for(int64_t a=start;a<end;){
+		int b=a&7,k=8-b;
+		if(k>end-a) k=end-a;
+		acc=(acc<<k)|((buf[a>>3]>>(8-b-k))&((1<<k)-1));
+		n+=k;
+		nbits+=k;
+		a+=k;
+		if((a&7)==0&&buf[(a>>3)-1]==0xFF) a+=8;	//skip stuffing
+		if(n>=8){
+			n-=8;
+			*q++=acc>>n;
+		}
+	}
+	if(n) *q++=acc<<(8-n);
+	t->len=(char*)q-t->buf;
+	binSet((uint8_t*)t->buf+o,nbits,2);
+}
+
+//write the container of the records in rec to f
+static void binWrite(FILE* f,const uint8_t* rec,size_t len){
+	struct textbuf seg,blk;
+	uint8_t head[BIN_HEADSIZE],pad[8]={0};
+	size_t o,runpos=0;
+	int nseg=0,nblock=0,run=0;
+	textInit(&seg,0);
+	textInit(&blk,0);
+	for(o=0;o<len;o+=binRecordLen(rec+o)){
+		const uint8_t* p=rec+o;
+		if(p[0]==BIN_Y||p[0]==BIN_C){
+			if(!run){
+				binPut(&seg,BIN_BLOCKS,1);
+				binPut(&seg,0,3);
+				runpos=seg.len;
+				binPut(&seg,0,4);
+				binPut(&seg,BIN_HEADSIZE+o,8);
+				nseg++;
+			}
+			run++;
+			binPut(&blk,BIN_HEADSIZE+o,8);
+			nblock++;
+			continue;
+		}
+		if(run) binSet((uint8_t*)seg.buf+runpos,run,4);
+		run=0;
+		binPut(&seg,p[0],1);
+		binPut(&seg,p[0]==BIN_RAW?0:p[1],1);
+		binPut(&seg,0,2);
+		binPut(&seg,p[0]==BIN_RAW?binGet(p+1,4):p[0]==BIN_DHT?binGet(p+2,2):1,4);
+		binPut(&seg,BIN_HEADSIZE+o,8);
+		nseg++;
+	}
+	if(run) binSet((uint8_t*)seg.buf+runpos,run,4);
+	int npad=(8-(len&7))&7;
+	memcpy(head,"JDCB",4);
+	binSet(head+4,BIN_VERSION,2);
+	binSet(head+6,BIN_HEADSIZE,2);
+	binSet(head+8,nseg,4);
+	binSet(head+12,nblock,4);
+	binSet(head+16,BIN_HEADSIZE+len+npad,8);
+	binSet(head+24,BIN_HEADSIZE+len+npad+seg.len,8);
+	fwrite(head,1,BIN_HEADSIZE,f);
+	fwrite(rec,1,len,f);
+	fwrite(pad,1,npad,f);
+	fwrite(seg.buf,1,seg.len,f);
+	fwrite(blk.buf,1,blk.len,f);
+	textFree(&seg);
+	textFree(&blk);
+}
+
 //decodifica Y or C block (DC+AC)
 //v=0 no messages
 //v=1 out on console
-//v=2 decoded output on f2
+//v=2 decoded output on t
+//v=3 binary records on t
+//v=4 no messages
 //type=0 Y
 //type=1 C
 //return value:
 // DECODE_UNKNOWN	-> unknown code
 // DECODE_ERR 		-> decode error
-// DECODE_OK 		-> decode ok
+// DECODE_OK 		-> decode ok (+ DC value <<8, + DECODE_TOOMANY)
 // DECODE_EOI 		-> EOI marker
 // DECODE_RESTART 	->RESTART marker (+ restart marker number <<8)
 // DECODE_PARTIAL_RESTART 	->partial decoding + RESTART marker (+ restart marker number <<8)
-int decodeBlock(FILE*f,FILE*f2,int v,int type){	
+static int decodeBlock(struct bitreader* br,struct textbuf* t,int v,int type){	
 	int nz;
-	int blockAddr=Rbitcount,endAddr;
+	int64_t blockAddr=bitpos(br),endAddr;
 	int dccoeff,rst;
-	if(type==0)	dccoeff=decodeHvalDC(YDC,f,v==2?0:f2);
-	else dccoeff=decodeHvalDC(CDC,f,v==2?0:f2);
+	if(type==0)	dccoeff=decodeHvalDC(br,&br->d->YDClut,0);
+	else dccoeff=decodeHvalDC(br,&br->d->CDClut,0);
 	if(dccoeff<-10000||dccoeff>10000){
 		if(dccoeff==HTAB_ERR){	//in case of error try advancing 1 bit
 			dccoeff=0;
-			getbit(f);	//advance 1 bit
+			getbit(br);	//advance 1 bit
 			if(v==1) printf("Huffman error (DC)\n");
-			if(v==2&&type==0) fprintf(f2,"\n<y>\n//[Y@0x%X.%d] Huffman error -> DC:0 \n0\n</y>",blockAddr>>3,blockAddr&7);
-			if(v==2&&type==1) fprintf(f2,"\n<c>\n//[C@0x%X.%d] Huffman error -> DC:0 \n0\n</c>",blockAddr>>3,blockAddr&7);
+			if(v==2){
+				textBlockHead(t,type,blockAddr);
+				textPuts(t,type==0?" Huffman error -> DC:0 \n0\n</y>":" Huffman error -> DC:0 \n0\n</c>");
+			}
+			if(v==3) binPutBlock(t,type,0,0,0,0);
 			return DECODE_ERR;
 		}
 		if(dccoeff==EOI_MARKER){
 			if(v==1) printf("EOI marker\n");
-			if(v==2) fprintf(f2,"\n<EOI></EOI>\n");
+			if(v==2) textPuts(t,"\n<EOI></EOI>\n");
 			return DECODE_EOI;
 		}
 		if(dccoeff<RESTART_MARKER){
 			rst=-dccoeff+RESTART_MARKER-0xD0;
 			if(v==1) printf("RESTART marker %d\n",rst);
-			if(v==2) fprintf(f2,"\n<restart>%d</restart>",rst);
+			if(v==2) textPrintf(t,"\n<restart>%d</restart>",rst);
+			if(v==3){
+				binPut(t,BIN_RESTART,1);
+				binPut(t,rst,1);
+			}
 			return DECODE_RESTART+(rst<<8);
 		}
 		else{ 
@@ -380,35 +1150,43 @@ int decodeBlock(FILE*f,FILE*f2,int v,int type){
 			return DECODE_UNKNOWN;
 		}
 	}
-	int ACAddr=Rbitcount;
+	int64_t ACAddr=bitpos(br);
 	int	coeff,ncoeff=1;
-	char coeffstr[1024]="",str[8];
-	if(v==1&&type==0) printf("0x%X.%d Y= %d",blockAddr>>3,blockAddr&7,dccoeff);
-	if(v==1&&type==1) printf("0x%X.%d C= %d",blockAddr>>3,blockAddr&7,dccoeff);
+	int ac[80],nac=0;	//AC coefficients (max 63 + ZRL)
+	if(v==1&&type==0) printf("0x%X.%d Y= %d",(int)(blockAddr>>3),(int)(blockAddr&7),dccoeff);
+	if(v==1&&type==1) printf("0x%X.%d C= %d",(int)(blockAddr>>3),(int)(blockAddr&7),dccoeff);
 	for(coeff=-1;coeff!=EOB&&ncoeff<64;){
-		if(type==0)	coeff=decodeHvalAC(YAC,f,v==2?0:f2);
-		else coeff=decodeHvalAC(CAC,f,v==2?0:f2);
+		if(type==0)	coeff=decodeHvalAC(br,&br->d->YAClut,0);
+		else coeff=decodeHvalAC(br,&br->d->CAClut,0);
 		if(coeff<0||coeff>0x2000000){
 			if(coeff==HTAB_ERR){
 				if(v==1) printf("Huffman error (AC)\n");
-				getbit(f);	//advance 1 bit
+				getbit(br);	//advance 1 bit
 				if(v==1) printf("Huffman error (AC)\n");
-				if(v==2&&type==0) fprintf(f2,"\n<y>\n//[Y@0x%X.%d] Huffman error -> DC:0 \n0\n</y>",blockAddr>>3,blockAddr&7);
-				if(v==2&&type==1) fprintf(f2,"\n<c>\n//[C@0x%X.%d] Huffman error -> DC:0 \n0\n</c>",blockAddr>>3,blockAddr&7);
+				if(v==2){
+					textBlockHead(t,type,blockAddr);
+					textPuts(t,type==0?" Huffman error -> DC:0 \n0\n</y>":" Huffman error -> DC:0 \n0\n</c>");
+				}
+				if(v==3) binPutBlock(t,type,0,0,0,0);
 				return DECODE_ERR;
 			}
 			if(coeff==EOI_MARKER){
 				if(v==1) printf("EOI marker\n");
-				if(v==2) fprintf(f2,"\n<EOI></EOI>\n");
+				if(v==2) textPuts(t,"\n<EOI></EOI>\n");
 				return DECODE_EOI;
 			}
 			if(coeff<RESTART_MARKER){
 				rst=-coeff+RESTART_MARKER-0xD0;
 				if(v==1) printf("RESTART marker %d\n",rst);
 				if(v==2){
-					if(type==0)	fprintf(f2,"\n<y>\n//[Y@0x%X.%d] DC:%d AC: truncated by restart marker\n%d\n</y>",blockAddr>>3,blockAddr&7,dccoeff,dccoeff);
-					else fprintf(f2,"\n<c>\n//[C@0x%X.%d] DC:%d AC: truncated by restart marker\n%d\n</c>",blockAddr>>3,blockAddr&7,dccoeff,dccoeff);
-					fprintf(f2,"\n<restart>%d</restart>",rst);
+					textBlockHead(t,type,blockAddr);
+					textPrintf(t," DC:%d AC: truncated by restart marker\n%d\n</%c>",dccoeff,dccoeff,type==0?'y':'c');
+					textPrintf(t,"\n<restart>%d</restart>",rst);
+				}
+				if(v==3){
+					binPutBlock(t,type,dccoeff,0,0,0);
+					binPut(t,BIN_RESTART,1);
+					binPut(t,rst,1);
 				}
 				return DECODE_PARTIAL_RESTART+(rst<<8);
 			}
@@ -422,7 +1200,7 @@ int decodeBlock(FILE*f,FILE*f2,int v,int type){
 		}
 		else if(coeff==ZRL){
 			if(v==1) printf(" 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0");
-			if(v==2) strcat(coeffstr," 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0");
+			for(nz=16;nz;nz--) ac[nac++]=0;
 			ncoeff+=16;
 		}
 		else{
@@ -430,166 +1208,3012 @@ int decodeBlock(FILE*f,FILE*f2,int v,int type){
 			ncoeff+=nz+1;
 			for(;nz;nz--){
 				if(v==1) printf(" 0");
-				if(v==2) strcat(coeffstr," 0");
+				ac[nac++]=0;
 			}
 			coeff&=0xFFFF;
 			if(coeff&0x1000) coeff|=0xFFFF0000;	//sign extension
 			if(v==1) printf(" %d",coeff);
-			if(v==2){
-				sprintf(str," %d",coeff);
-				strcat(coeffstr,str);
-			}
+			ac[nac++]=coeff;
 		}
 	}
-	endAddr=Rbitcount;
+	endAddr=bitpos(br);
 	if(v==1){
-		printf(" (%d bit)\n",endAddr-blockAddr);
+		printf(" (%d bit)\n",(int)(endAddr-blockAddr));
 		if(ncoeff>64) printf("Too many AC coefficients! (%d)\n",ncoeff);
 	}
 	if(v==2){
-		if(type==0)	fprintf(f2,"\n<y>\n//[Y@0x%X.%d] DC:%d AC:%s\n%d",blockAddr>>3,blockAddr&7,dccoeff,coeffstr,dccoeff);
-		else fprintf(f2,"\n<c>\n//[C@0x%X.%d] DC:%d AC:%s\n%d",blockAddr>>3,blockAddr&7,dccoeff,coeffstr,dccoeff);
-//		fprintf(f2,"\n//block %d %X, AC %d %X, end %d ",blockAddr,blockAddr/8,ACAddr,ACAddr/8,endAddr);
-		int addr0=ACAddr/8;
-		fseek(f,addr0,0);
-		Rbitcount=addr0*8;
-		getbit(0);	//reset bitcount
-		for(;Rbitcount<ACAddr;getbit(f));	//start of AC data
-		fprintf(f2," 0b");
-		for(;Rbitcount<endAddr;) fprintf(f2,"%d",getbit(f));
-		if(type==0)	fprintf(f2,"\n</y>");
-		else fprintf(f2,"\n</c>");
-	}
-	return DECODE_OK;
-}
-
-//find "<tag>" in file f
-//return the position of "<" and copy tag (without <>) in buf
-int tag(FILE* f,char* buf,int size){
-	if(!f) return -1;
-	int r,n=0,pos;
-	buf[0]=0;
-	for(r=fgetc(f);r!=EOF&&r!='<';r=fgetc(f)){
-		if(r=='#') for(r=fgetc(f);r!=EOF&&r!='\n';r=fgetc(f));
-		else if(r=='/'){
-			r=fgetc(f);
-			if(r=='/') for(r=fgetc(f);r!=EOF&&r!='\n';r=fgetc(f));
+		textBlockHead(t,type,blockAddr);
+		textPuts(t," DC:");
+		textPutInt(t,dccoeff);
+		textPuts(t," AC:");
+		for(int i=0;i<nac;i++){
+			textPutc(t,' ');
+			textPutInt(t,ac[i]);
 		}
+		textPutc(t,'\n');
+		textPutInt(t,dccoeff);
+//		textPrintf(t,"\n//block %d %X, AC %d %X, end %d ",blockAddr,blockAddr/8,ACAddr,ACAddr/8,endAddr);
+		textPuts(t," 0b");
+		textPutBits(t,br->buf,ACAddr,endAddr);	//AC data
+		textPuts(t,type==0?"\n</y>":"\n</c>");
 	}
-	if(r=='<'){
-		pos=ftell(f);
-		for(r=fgetc(f);r!=EOF&&r!='>'&&n<size-2;r=fgetc(f)) buf[n++]=r;
-		buf[n]=0;
-		if(r=='>') return pos-1;
+	if(v==3) binPutBlock(t,type,dccoeff,br->buf,ACAddr,endAddr);
+	if(br->coef){
+		br->coef[0]=dccoeff;
+		for(int i=0;i<63;i++) br->coef[i+1]=i<nac?ac[i]:0;
 	}
-	return -1;
+	return DECODE_OK+(ncoeff>64?DECODE_TOOMANY:0)+dccoeff*256;
 }
 
-//convert raw data and save it on file f
-//returns number of extracted bits
-int parseRaw(const char* inbuf,FILE* f){
-//example:
-//0xFFD8FFE1115C45786966000049492A00080000000C000001040001000000200A
-//0b10111010000010011100101110100
-	int s=0,n=0;
-	uint8_t xx,c;
-	for(int i=0;i<strlen(inbuf);i++){
-		c=toupper(inbuf[i]);
-		switch(s){
-			case 0:
-				if(c=='0') s=1; //0
-				break;
-			case 1:
-				if(c=='X') s=2;	//0x
-				else if(c=='B') s=4;	//0b
-				else s=0;
-				break;
-			case 2:		//hex 1
-				if((c>='0'&&c<='9')||(c>='A'&&c<='F')){
-					if(c<='9') xx=c-'0';
-					else xx=c-'A'+10;
-					s=3;
-				}
-				else s=0;	// -> 0x
-				break;
-			case 3:		//hex 2
-				if((c>='0'&&c<='9')||(c>='A'&&c<='F')){
-					if(c<='9') xx=(xx<<4)+c-'0';
-					else xx=(xx<<4)+c-'A'+10;
-					s=2;
-				}
-				else s=0;	// -> 0x
-				fputc(xx,f);
-				n+=8;
-				break;
-			case 4:		//binary
-				n++;
-				if(c=='0') putbit(0,f);//printf("0");
-				else if(c=='1') putbit(1,f);//printf("1");
-				else{
-					s=0;	// -> 0x/0b
-					n--;
-				}
-				break;
-			default:
-				s=0;
+//decode Y or C block (type as decodeBlock) without output, for its DC value only:
+//AC coefficients are skipped by their run/size codes
+//return value: as decodeBlock
+static int decodeBlockDC(struct bitreader* br,int type){
+	const struct huffLUT* ac=type==0?&br->d->YAClut:&br->d->CAClut;
+	int n,s,ncoeff=1;
+	int dccoeff=decodeHvalDC(br,type==0?&br->d->YDClut:&br->d->CDClut,0);
+	if(dccoeff<-10000||dccoeff>10000){
+		if(dccoeff==HTAB_ERR){
+			getbit(br);	//advance 1 bit
+			return DECODE_ERR;
 		}
+		if(dccoeff==EOI_MARKER) return DECODE_EOI;
+		if(dccoeff<RESTART_MARKER) return DECODE_RESTART+((-dccoeff+RESTART_MARKER-0xD0)<<8);
+		return DECODE_UNKNOWN;
 	}
+	while(ncoeff<64){
+		s=huffCode(br,ac,17,&n);
+		if(s>=0&&br->nbits<n+(s&0xF)) s=streamerr(skipmarker(br));
+		if(s<0){
+			if(s==HTAB_ERR){
+				getbit(br);
+				return DECODE_ERR;
+			}
+			if(s==EOI_MARKER) return DECODE_EOI;
+			if(s<RESTART_MARKER) return DECODE_PARTIAL_RESTART+((-s+RESTART_MARKER-0xD0)<<8);
+			return DECODE_UNKNOWN;
+		}
+		skipbits(br,n+(s&0xF));
+		if(s==0) break;		//EOB
+		ncoeff+=s==0xF0?16:(s>>4)+1;
+	}
+	return DECODE_OK+(ncoeff>64?DECODE_TOOMANY:0)+dccoeff*256;
+}
+
+#define RESYNC_BITS 2048		//bit offsets tried after a Huffman error
+#define RESYNC_BLOCKS 16		//valid blocks needed to accept an offset at once
+//check the block at the current position without output
+//return value:
+//1 	-> valid block (DC size<=11, AC size<=10, at most 63 coefficients)
+//0 	-> no Huffman code or size out of range
+//-1	-> more than 63 coefficients
+//EOF_ERR,EOI_MARKER,RESTART_MARKER-(0xD0..0xD7) -> stream ends inside the block; marker skipped
+static int blockValid(struct bitreader* br,const struct huffLUT* dc,const struct huffLUT* ac){
+	int n,s,ncoeff=1;
+	s=huffCode(br,dc,16,&n);
+	if(s==HTAB_ERR||s>11) return 0;
+	if(s<0) return s;
+	if(br->nbits<n+s) return streamerr(skipmarker(br));
+	skipbits(br,n+s);
+	while(ncoeff<64){
+		s=huffCode(br,ac,17,&n);
+		if(s==HTAB_ERR||(s>=0&&(s&0xF)>10)) return 0;
+		if(s<0) return s;
+		if(br->nbits<n+(s&0xF)) return streamerr(skipmarker(br));
+		skipbits(br,n+(s&0xF));
+		if(s==0) return 1;
+		ncoeff+=s==0xF0?16:(s>>4)+1;
+	}
+	return ncoeff==64?1:-1;
+}
+
+//find where to resume decoding after a Huffman error, trying the bit offsets from addr on
+//with block # iblock: every offset is scored by the number of valid blocks that follow it
+//and the best one is returned (the first with RESYNC_BLOCKS valid blocks, the earliest on ties)
+//if no offset starts a valid block all the offsets tried are skipped
+//the result depends only on addr and iblock, as needed by the parallel decoders
+static int64_t resync(struct bitreader* br,int64_t addr,int iblock){
+	const struct decoder* d=br->d;
+	const char* MCUdef=d->MCUdef;
+	int mculen=strlen(MCUdef),best=0,r=0;
+	int64_t c,bestpos=addr;
+	for(c=addr;c<addr+RESYNC_BITS&&best<RESYNC_BLOCKS&&r>=-1;c++){
+		int run,ib=iblock;
+		if(c>>3>0&&c>>3<br->size&&br->buf[(c>>3)-1]==0xFF) c=((c>>3)+1)*8;	//skip bit stuffing
+		bitseek(br,c);
+		for(run=0;run<RESYNC_BLOCKS;run++){
+			if(MCUdef[ib]=='Y') r=blockValid(br,&d->YDClut,&d->YAClut);
+			else r=blockValid(br,&d->CDClut,&d->CAClut);
+			if(r<=0) break;
+			if(++ib>=mculen) ib=0;
+		}
+		if(run>best){
+			best=run;
+			bestpos=c;
+		}
+	}
+	return best?bestpos:c-1;
+}
+
+//check the scan from the current position up to EOI or the end of the file, stopping at the
+//first structural error; nmcu: MCUs expected from SOF0 (-1: unknown)
+//return VERIFY_xxx, with the bit address of the error (the block or marker) in *errpos
+static int verifyScan(struct bitreader* br,int nmcu,int64_t* errpos){
+	const struct decoder* d=br->d;
+	const char* MCUdef=d->MCUdef;
+	int mculen=strlen(MCUdef),iblock=0,mcu=0,count=0,next_rst=0,r;
+	for(;;){
+		*errpos=bitpos(br);
+		if(MCUdef[iblock]=='Y') r=blockValid(br,&d->YDClut,&d->YAClut);
+		else r=blockValid(br,&d->CDClut,&d->CAClut);
+		if(r==1){
+			if(iblock==0&&(++count>d->restartInt&&d->restartInt>0)) return VERIFY_RESTART;
+			if(iblock==0&&nmcu>=0&&mcu>=nmcu) return VERIFY_MCUCOUNT;
+			if(++iblock>=mculen){
+				iblock=0;
+				mcu++;
+			}
+			continue;
+		}
+		if(r==0) return VERIFY_HUFFMAN;
+		if(r==-1) return VERIFY_COEFF;
+		*errpos=bitpos(br)-16;
+		if(r<=RESTART_MARKER-0xD0&&r>=RESTART_MARKER-0xD7){
+			if(iblock||r!=RESTART_MARKER-0xD0-next_rst||count!=d->restartInt) return VERIFY_RESTART;
+			next_rst=(next_rst+1)&7;
+			count=0;
+			continue;
+		}
+		if(r==EOF_ERR) *errpos=bitpos(br);
+		break;	//EOI or end of file
+	}
+	return iblock||(nmcu>=0&&mcu!=nmcu)?VERIFY_MCUCOUNT:VERIFY_OK;
+}
+
+//find the start of every MCU of the scan from the current position up to EOI or the
+//end of the file, as decodeScan does (with resync after errors); the addresses go in
+//d->mcupos relative to bit address base, followed by the end of the scan
+static void mcuStarts(struct bitreader* br,struct decoder* d,int64_t base){
+	const char* MCUdef=d->MCUdef;
+	int mculen=strlen(MCUdef),iblock=0,size=256,r;
+	int64_t pos,start=0;
+	d->nmcu=0;
+	d->mcupos=realloc(d->mcupos,size*sizeof(int64_t));
+	for(;;){
+		pos=bitpos(br);
+		if(iblock==0) start=pos;
+		if(MCUdef[iblock]=='Y') r=blockValid(br,&d->YDClut,&d->YAClut);
+		else r=blockValid(br,&d->CDClut,&d->CAClut);
+		if(r<-1&&r>=RESTART_MARKER-0xD7&&r<=RESTART_MARKER-0xD0){
+			iblock=0;	//MCU ended by the restart marker
+			continue;
+		}
+		if(r<-1) break;		//EOI or end of file
+		if(iblock==0){
+			if(d->nmcu+1>=size){
+				size*=2;
+				d->mcupos=realloc(d->mcupos,size*sizeof(int64_t));
+			}
+			d->mcupos[d->nmcu++]=start-base;
+		}
+		if(++iblock>=mculen) iblock=0;
+		if(r==0) bitseek(br,resync(br,pos+1,iblock));
+	}
+	d->mcupos[d->nmcu]=pos-base;
+}
+
+//MCU header recorded in a text buffer, to be written when the MCU number is known
+struct mcuhead{
+	size_t offset;		//position in text
+	int mcu;			//MCU number, relative to the start of the text
+	int64_t pos;		//bit address
+};
+
+//block start recorded while decoding, to resume the output from any block
+struct blockhead{
+	int64_t pos;		//bit address
+	int iblock;			//block # in MCU
+	int mcu,Ny,Nc;		//counters before the block
+	int nhead;			//MCU headers before the block
+	size_t offset;		//position in text
+	size_t msgoffset;	//position in console messages
+};
+
+//decoder state at the start of an MCU, to resume decoding from there (-index)
+struct checkpoint{
+	int64_t pos;		//bit address
+	int mcu,restartCount,next_rstnum,Ny,Nc;
+	int dc[32];			//DC predictors
+};
+
+//state of the MCU sequence while decoding a scan
+struct scanstate{
+	int mcucount;		//MCUs found
+	int iblock;			//next block of current MCU
+	int restartCount;	//MCUs since last restart marker
+	int next_rstnum;	//expected restart marker #
+	int Ny,Nc;			//Y and C blocks found
+	int rstErrStat[50];	//restart intervals with too many MCU, by number of extra MCU
+	int rstErrStat_extra;
+	int Mx;				//MCUs per row
+	struct mcuhead* head;	//!=0: MCU headers are recorded here instead of being written
+	int nhead,headsize;
+	struct blockhead* blk;	//!=0: block starts are recorded here
+	int nblk,blksize;
+	struct textbuf* msg;	//!=0: console messages are written here instead of the log
+	uint8_t* flags;		//!=0: errors of every MCU (MCU_xxx) are recorded here (analysis)
+	int flagsize;
+	int nflag[5];		//errors found, by kind
+	int dc[32];			//DC predictors: Y, first C, second C ...
+	struct checkpoint* ck;	//a checkpoint every ckstep MCUs (ckstep>0) is recorded here
+	int nck,cksize,ckstep;
+	int mcustop;		//>0: stop at the start of this MCU
+	int skip;			//1: decode only, no text (MCUs outside a range or region)
+	int16_t* coef;		//!=0: coefficients of every block (64 each, DC absolute) of the first ncoef MCUs
+	int ncoef;
+	int dconly;			//1: blocks decoded for their DC only (decodeBlockDC), 1 coefficient each
+};
+
+//errors recorded by the analysis for every MCU
+#define MCU_HUFFMAN 1	//Huffman code error
+#define MCU_COEFF 2		//block with more than 63 AC coefficients
+#define MCU_RESTART 4	//restart interval or marker # error
+#define MCU_MISSING 8	//missing component
+#define MCU_DC 16		//DC discontinuity
+#define DC_JUMP 1024	//DC difference taken as a discontinuity
+static const char* mcuflagnames[]={"huffman","coefficients","restart","missing_component","dc"};
+
+//record error f of MCU mcu (analysis only)
+static void mcuFlag(struct scanstate* s,int mcu,int f){
+	if(!s->flags||mcu<0) return;
+	if(mcu>=s->flagsize){
+		int n=s->flagsize;
+		while(s->flagsize<=mcu) s->flagsize*=2;
+		s->flags=realloc(s->flags,s->flagsize);
+		memset(s->flags+n,0,s->flagsize-n);
+	}
+	s->flags[mcu]|=f;
+	s->nflag[__builtin_ctz(f)]++;
+}
+
+//write MCU header
+static void textMCUHead(struct textbuf* t,int mcucount,int Mx,int64_t pos){
+	textPuts(t,"\n//************ MCU ");
+	textPutInt(t,mcucount);
+	textPuts(t," (");
+	textPutInt(t,mcucount%Mx);
+	textPutc(t,',');
+	textPutInt(t,mcucount/Mx);
+	textPuts(t,") (@0x");
+	textPutX(t,pos>>3);
+	textPutc(t,'.');
+	textPutc(t,'0'+(pos&7));
+	textPuts(t,"):");
+}
+
+//decode MCUs from the current bit position up to bit address limit, text on t
+//stoprst=1: stop after the first restart marker
+//return value: 1 if stopped at a restart marker, 0 if limit reached
+static int decodeScan(struct bitreader* br,struct scanstate* s,struct textbuf* t,int64_t limit,int stoprst){
+	const struct decoder* d=br->d;
+	int decode_result=DECODE_UNKNOWN,errnum,rst;
+	int mculen=strlen(d->MCUdef);
+	int bin=d->format==FORMAT_BIN,an=d->format==FORMAT_ANALYZE;
+	int quiet=bin||an||s->skip||s->coef;	//no text
+	int v=s->skip||s->coef?0:an?4:bin?3:2;
+	int comp[32];		//DC predictor of every block # in MCU: Y, first C, second C ...
+	for(int i=0,nc=0;i<mculen;i++) comp[i]=d->MCUdef[i]=='C'?++nc:0;
+	for(int64_t pos=bitpos(br);pos<limit;pos=bitpos(br)){
+		if(s->iblock==0&&s->mcustop>0&&s->mcucount>=s->mcustop) break;
+		if(s->iblock==0&&s->ckstep>0&&s->mcucount%s->ckstep==0&&(s->nck==0||s->ck[s->nck-1].mcu!=s->mcucount)){
+			if(s->nck==s->cksize){
+				s->cksize=s->cksize?s->cksize*2:64;
+				s->ck=realloc(s->ck,s->cksize*sizeof(struct checkpoint));
+			}
+			struct checkpoint* c=s->ck+s->nck++;
+			c->pos=pos;
+			c->mcu=s->mcucount;
+			c->restartCount=s->restartCount;
+			c->next_rstnum=s->next_rstnum;
+			c->Ny=s->Ny;
+			c->Nc=s->Nc;
+			memcpy(c->dc,s->dc,sizeof(c->dc));
+		}
+		if(s->blk){
+			if(s->nblk==s->blksize){
+				s->blksize*=2;
+				s->blk=realloc(s->blk,s->blksize*sizeof(struct blockhead));
+			}
+			struct blockhead* b=s->blk+s->nblk++;
+			b->pos=pos;
+			b->iblock=s->iblock;
+			b->mcu=s->mcucount;
+			b->Ny=s->Ny;
+			b->Nc=s->Nc;
+			b->nhead=s->nhead;
+			b->offset=t->len;
+			b->msgoffset=s->msg?s->msg->len:0;
+		}
+		if(s->iblock==0&&!quiet){
+			if(s->head){
+				if(s->nhead==s->headsize){
+					s->headsize=s->headsize?s->headsize*2:256;
+					s->head=realloc(s->head,s->headsize*sizeof(struct mcuhead));
+				}
+				s->head[s->nhead].offset=t->len;
+				s->head[s->nhead].mcu=s->mcucount;
+				s->head[s->nhead++].pos=pos;
+			}
+			else textMCUHead(t,s->mcucount,s->Mx,pos);
+		}
+		int16_t* coef=s->coef&&s->mcucount<s->ncoef?s->coef+((int64_t)s->mcucount*mculen+s->iblock)*(s->dconly?1:64):0;
+		br->coef=s->dconly?0:coef;
+		if(s->dconly) decode_result=decodeBlockDC(br,d->MCUdef[s->iblock]=='C'?C_BLOCK:Y_BLOCK);
+		else if(d->MCUdef[s->iblock]=='Y')	decode_result=decodeBlock(br,t,v,Y_BLOCK);
+		else if(d->MCUdef[s->iblock]=='C')	decode_result=decodeBlock(br,t,v,C_BLOCK);
+		br->coef=0;
+		rst=decode_result>>8;
+		if((decode_result&0xF)==DECODE_PARTIAL_RESTART){
+			if(d->MCUdef[s->iblock]=='Y') s->Ny++;
+			if(d->MCUdef[s->iblock]=='C') s->Nc++;
+			s->iblock++;
+		}					
+		if((decode_result&0xF)==DECODE_RESTART||(decode_result&0xF)==DECODE_PARTIAL_RESTART){
+			if(s->restartCount<d->restartInt){
+				mcuFlag(s,s->iblock?s->mcucount:s->mcucount-1,MCU_RESTART);
+				if(s->iblock<mculen&&!quiet) textPrintf(t,"\n//Restart interval error (%d: %d MCU instead of %d)",s->restartCount-d->restartInt,s->restartCount,d->restartInt);
+			}
+			s->restartCount=0;
+			memset(s->dc,0,sizeof(s->dc));
+			if(s->iblock>0){
+				if(s->iblock<mculen) mcuFlag(s,s->mcucount,MCU_MISSING);
+				s->mcucount++;
+				if(s->iblock<mculen&&!quiet) textPrintf(t,"\n//MCU error: missing component  (%d instead of %d)",s->iblock,mculen);
+				s->iblock=0;
+			}
+			if(rst!=s->next_rstnum) mcuFlag(s,s->mcucount-1,MCU_RESTART);
+			if(rst!=s->next_rstnum&&!quiet){
+				textPrintf(t,"\n//Restart marker # error (%d instead of %d)",rst,s->next_rstnum);
+			}
+			s->next_rstnum=rst+1;
+			if(s->next_rstnum>7) s->next_rstnum=0;
+			if(stoprst) return 1;
+		}
+		else if((decode_result&0xF)==DECODE_OK||(decode_result&0xF)==DECODE_ERR){
+			if(d->restartInt>0&&s->iblock==0){	//on new MCU only
+				s->restartCount++;
+				errnum=s->restartCount-d->restartInt;
+				if(errnum>0){
+					mcuFlag(s,s->mcucount,MCU_RESTART);
+					if(!quiet) textPrintf(t,"\n//Restart interval error (+%d: %d MCU instead of %d)",errnum,s->restartCount,d->restartInt);
+					if(errnum<50) s->rstErrStat[errnum]++;
+					else s->rstErrStat_extra=1;
+				}
+			}
+			int c=comp[s->iblock];
+			if((decode_result&0xF)==DECODE_ERR) mcuFlag(s,s->mcucount,MCU_HUFFMAN);
+			else{
+				int dc=decode_result>>8;
+				if(decode_result&DECODE_TOOMANY) mcuFlag(s,s->mcucount,MCU_COEFF);
+				s->dc[c]+=dc;
+				if(an&&(dc>DC_JUMP||dc<-DC_JUMP||s->dc[c]<-2048||s->dc[c]>2047)){
+					mcuFlag(s,s->mcucount,MCU_DC);
+					s->dc[c]=s->dc[c]<-2048?-2048:s->dc[c]>2047?2047:s->dc[c];
+				}
+			}
+			if(coef) coef[0]=s->dc[c];
+			if(d->MCUdef[s->iblock]=='Y') s->Ny++;
+			if(d->MCUdef[s->iblock]=='C') s->Nc++;
+			s->iblock++;
+			if(s->iblock>=mculen){
+				s->iblock=0;
+				s->mcucount++;
+			}					
+			if((decode_result&0xF)==DECODE_ERR){	//skip the damaged data
+				int64_t sync=resync(br,pos+1,s->iblock);
+				if(!quiet) textPrintf(t,"\n//Huffman resync: %d bits skipped (@0x%X.%d-0x%X.%d)",(int)(sync-pos),(int)(pos>>3),(int)(pos&7),(int)(sync>>3),(int)(sync&7));
+				bitseek(br,sync);
+			}
+		}
+		else if(decode_result==DECODE_EOI);
+		else{
+			if(s->msg) textPrintf(s->msg,"MCU decoding error (0x%X)\n",decode_result);
+			else logPrintf(d->log,"MCU decoding error (0x%X)\n",decode_result);
+			//break;
+		}					
+	}
+	return 0;
+}
+
+//restart interval decoded by a worker thread
+struct interval{
+	int start;			//first byte
+	int next_rstnum;	//expected restart marker #
+	struct scanstate st;
+	struct textbuf out;	//text without MCU headers
+	struct textbuf msg;	//console messages
+	int ended;			//1 if ended with a restart marker
+	int done;
+};
+
+//shared state of the worker threads
+struct intervalpool{
+	struct interval* iv;
+	int n;				//number of intervals
+	int next;			//next interval to decode
+	int written;		//intervals already written
+	int window;			//max intervals decoded ahead of written ones
+	int cancel;
+	const struct decoder* d;
+	int64_t limit;
+	int Mx;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void* intervalWorker(void* arg){
+	struct intervalpool* p=arg;
+	struct interval* iv;
+	struct bitreader r,*br=&r;
+	readerInit(br,p->d);
+	for(;;){
+		pthread_mutex_lock(&p->lock);
+		while(p->next<p->n&&p->next>=p->written+p->window&&!p->cancel) pthread_cond_wait(&p->cond,&p->lock);
+		if(p->next>=p->n||p->cancel){
+			pthread_mutex_unlock(&p->lock);
+			return 0;
+		}
+		iv=p->iv+p->next++;
+		pthread_mutex_unlock(&p->lock);
+		bitseek(br,iv->start*8LL);
+		memset(&iv->st,0,sizeof(struct scanstate));
+		iv->st.Mx=p->Mx;
+		iv->st.next_rstnum=iv->next_rstnum;
+		iv->st.msg=&iv->msg;
+		iv->st.head=malloc(256*sizeof(struct mcuhead));
+		iv->st.headsize=256;
+		textInit(&iv->out,0);
+		textInit(&iv->msg,0);
+		iv->ended=decodeScan(br,&iv->st,&iv->out,p->limit,1);
+		pthread_mutex_lock(&p->lock);
+		iv->done=1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+//decode scan starting at byte start, up to bit address limit, using nthreads threads
+//the scan is split at restart markers; every interval is decoded to its own text buffer
+//and the buffers are written in order, with the same result as decodeScan
+static void decodeScanParallel(struct bitreader* br,struct scanstate* s,struct textbuf* t,int start,int64_t limit,int nthreads){
+	struct intervalpool p;
+	const uint8_t* data=br->buf;
+	int size=br->size;
+	int n=1,i,k;
+	const uint8_t* q;
+	//find restart markers, skipping bytes after 0xFF as the bit reader does
+	for(i=start;i<size&&(q=memchr(data+i,0xFF,size-i));i+=2){
+		i=q-data;
+		if(i+1<size&&data[i+1]>=0xD0&&data[i+1]<=0xD7) n++;
+	}
+	if(n<2){
+		decodeScan(br,s,t,limit,0);
+		return;
+	}
+	memset(&p,0,sizeof(p));
+	p.iv=calloc(n,sizeof(struct interval));
+	p.iv[0].start=start;
+	for(k=1,i=start;i<size&&(q=memchr(data+i,0xFF,size-i));i+=2){
+		i=q-data;
+		if(i+1<size&&data[i+1]>=0xD0&&data[i+1]<=0xD7){
+			p.iv[k].start=i+2;
+			p.iv[k].next_rstnum=(data[i+1]-0xD0+1)&7;
+			k++;
+		}
+	}
+	p.n=n;
+	p.window=4*nthreads;
+	p.d=br->d;
+	p.limit=limit;
+	p.Mx=s->Mx;
+	pthread_mutex_init(&p.lock,0);
+	pthread_cond_init(&p.cond,0);
+	pthread_t* th=malloc(nthreads*sizeof(pthread_t));
+	for(i=0;i<nthreads;i++) pthread_create(th+i,0,intervalWorker,&p);
+	for(k=0;k<n;k++){
+		struct interval* iv=p.iv+k;
+		pthread_mutex_lock(&p.lock);
+		while(!iv->done) pthread_cond_wait(&p.cond,&p.lock);
+		pthread_mutex_unlock(&p.lock);
+		size_t o=0;
+		for(i=0;i<iv->st.nhead;i++){	//text with MCU headers
+			struct mcuhead* h=iv->st.head+i;
+			textWrite(t,iv->out.buf+o,h->offset-o);
+			textMCUHead(t,s->mcucount+h->mcu,s->Mx,h->pos);
+			o=h->offset;
+		}
+		textWrite(t,iv->out.buf+o,iv->out.len-o);
+		if(iv->msg.len&&br->d->log) fwrite(iv->msg.buf,1,iv->msg.len,br->d->log);
+		s->mcucount+=iv->st.mcucount;
+		s->Ny+=iv->st.Ny;
+		s->Nc+=iv->st.Nc;
+		for(i=0;i<50;i++) s->rstErrStat[i]+=iv->st.rstErrStat[i];
+		s->rstErrStat_extra|=iv->st.rstErrStat_extra;
+		s->iblock=iv->st.iblock;
+		s->restartCount=iv->st.restartCount;
+		s->next_rstnum=iv->st.next_rstnum;
+		free(iv->st.head);
+		textFree(&iv->out);
+		textFree(&iv->msg);
+		pthread_mutex_lock(&p.lock);
+		p.written=k+1;
+		if(!iv->ended) p.cancel=1;	//limit reached: nothing more to write
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+		if(!iv->ended) break;
+	}
+	for(i=0;i<nthreads;i++) pthread_join(th[i],0);
+	for(k++;k<n;k++){		//intervals decoded past the limit
+		free(p.iv[k].st.head);
+		textFree(&p.iv[k].out);
+		textFree(&p.iv[k].msg);
+	}
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.cond);
+	free(th);
+	free(p.iv);
+}
+
+//scan chunk decoded speculatively by a worker thread
+struct chunk{
+	int start;			//first byte
+	int64_t limit;		//bit address where decoding stops
+	int iblock;			//block # in MCU of the first block (-1: unknown)
+	struct scanstate st;
+	struct textbuf out;	//text without MCU headers
+	struct textbuf msg;	//console messages
+	int64_t end;		//bit address of the first block not decoded
+	int done;
+};
+
+//shared state of the speculative decoder threads
+struct chunkpool{
+	struct chunk* ck;
+	int n;				//number of chunks
+	int next;			//next chunk to decode
+	const struct decoder* d;
+	int Mx;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+//guess the block # in MCU of a block starting at bit address addr:
+//the one giving the longest run of correctly decoded blocks
+static int guessBlock(struct bitreader* br,int64_t addr){
+	const char* MCUdef=br->d->MCUdef;
+	int mculen=strlen(MCUdef),best=0,bestrun=-1;
+	for(int i=0;i<mculen;i++){
+		int run,ib=i;
+		bitseek(br,addr);
+		for(run=0;run<64;run++){
+			if((decodeBlock(br,0,0,MCUdef[ib]=='Y'?Y_BLOCK:C_BLOCK)&0xF)!=DECODE_OK) break;
+			if(++ib>=mculen) ib=0;
+		}
+		if(run>bestrun){
+			bestrun=run;
+			best=i;
+		}
+	}
+	return best;
+}
+
+static void* chunkWorker(void* arg){
+	struct chunkpool* p=arg;
+	struct chunk* c;
+	struct bitreader r,*br=&r;
+	readerInit(br,p->d);
+	for(;;){
+		pthread_mutex_lock(&p->lock);
+		if(p->next>=p->n){
+			pthread_mutex_unlock(&p->lock);
+			return 0;
+		}
+		c=p->ck+p->next++;
+		pthread_mutex_unlock(&p->lock);
+		memset(&c->st,0,sizeof(struct scanstate));
+		c->st.iblock=c->iblock>=0?c->iblock:guessBlock(br,c->start*8LL);
+		c->st.Mx=p->Mx;
+		c->st.msg=&c->msg;
+		c->st.head=malloc(256*sizeof(struct mcuhead));
+		c->st.headsize=256;
+		c->st.blk=malloc(256*sizeof(struct blockhead));
+		c->st.blksize=256;
+		textInit(&c->out,0);
+		textInit(&c->msg,0);
+		bitseek(br,c->start*8LL);
+		decodeScan(br,&c->st,&c->out,c->limit,0);
+		c->end=bitpos(br);
+		pthread_mutex_lock(&p->lock);
+		c->done=1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+//find the block of chunk c starting at bit address pos with block # iblock
+//return its index, -1 if not found
+static int findBlock(struct chunk* c,int64_t pos,int iblock){
+	int a=0,b=c->st.nblk;
+	while(a<b){		//first block at pos or after
+		int m=(a+b)/2;
+		if(c->st.blk[m].pos<pos) a=m+1;
+		else b=m;
+	}
+	for(;a<c->st.nblk&&c->st.blk[a].pos==pos;a++) if(c->st.blk[a].iblock==iblock) return a;
+	return -1;
+}
+
+#define CHUNKSIZE 0x10000
+//decode scan starting at byte start, up to bit address limit, using nthreads threads,
+//for scans without restart markers
+//the scan is split in chunks that are decoded from a guessed block boundary; the Huffman
+//code resynchronizes after a few blocks, so once the correct decoding reaches a block
+//decoded by the next chunk the rest of that chunk is taken as is. Blocks before that are
+//decoded again serially: the result is the same as decodeScan
+static void decodeScanSpeculative(struct bitreader* br,struct scanstate* s,struct textbuf* t,int start,int64_t limit,int nthreads){
+	struct chunkpool p;
+	const uint8_t* data=br->buf;
+	int size=br->size;
+	int n,i,k;
+	int len=(limit>>3)-start;
+	n=len/CHUNKSIZE;
+	if(n>4*nthreads) n=4*nthreads;
+	if(br->d->restartInt>=0){	//restart markers would break the scan in intervals
+		const uint8_t* q;
+		for(i=start;i<size&&(q=memchr(data+i,0xFF,size-i));i+=2){
+			i=q-data;
+			if(i+1<size&&data[i+1]>=0xD0&&data[i+1]<=0xD7) n=0;
+		}
+	}
+	if(n<2){
+		decodeScan(br,s,t,limit,0);
+		return;
+	}
+	memset(&p,0,sizeof(p));
+	p.ck=calloc(n,sizeof(struct chunk));
+	for(k=0;k<n;k++){
+		int o=start+(int64_t)len*k/n;
+		while(k&&o<size&&data[o-1]==0xFF) o++;	//skip bit stuffing
+		p.ck[k].start=o;
+		p.ck[k].iblock=-1;
+		if(k) p.ck[k-1].limit=o*8LL;
+	}
+	p.ck[0].iblock=s->iblock;
+	p.ck[n-1].limit=limit;
+	p.n=n;
+	p.d=br->d;
+	p.Mx=s->Mx;
+	pthread_mutex_init(&p.lock,0);
+	pthread_cond_init(&p.cond,0);
+	pthread_t* th=malloc(nthreads*sizeof(pthread_t));
+	for(i=0;i<nthreads;i++) pthread_create(th+i,0,chunkWorker,&p);
+	int64_t pos=start*8LL,rpos=pos;	//decoded up to pos; bit reader at rpos
+	for(k=0;k<n;k++){
+		struct chunk* c=p.ck+k;
+		pthread_mutex_lock(&p.lock);
+		while(!c->done) pthread_cond_wait(&p.cond,&p.lock);
+		pthread_mutex_unlock(&p.lock);
+		while(pos<limit&&pos<c->end){
+			int j=findBlock(c,pos,s->iblock);
+			if(j>=0){	//in sync: take the rest of the chunk
+				struct blockhead* b=c->st.blk+j;
+				size_t o=b->offset;
+				for(i=b->nhead;i<c->st.nhead;i++){	//text with MCU headers
+					struct mcuhead* h=c->st.head+i;
+					textWrite(t,c->out.buf+o,h->offset-o);
+					textMCUHead(t,s->mcucount+h->mcu-b->mcu,s->Mx,h->pos);
+					o=h->offset;
+				}
+				textWrite(t,c->out.buf+o,c->out.len-o);
+				if(c->msg.len>b->msgoffset&&br->d->log) fwrite(c->msg.buf+b->msgoffset,1,c->msg.len-b->msgoffset,br->d->log);
+				s->mcucount+=c->st.mcucount-b->mcu;
+				s->Ny+=c->st.Ny-b->Ny;
+				s->Nc+=c->st.Nc-b->Nc;
+				s->iblock=c->st.iblock;
+				pos=c->end;
+				break;
+			}
+			if(rpos!=pos) bitseek(br,pos);
+			decodeScan(br,s,t,pos+1,0);	//one block
+			pos=rpos=bitpos(br);
+		}
+		free(c->st.head);
+		free(c->st.blk);
+		textFree(&c->out);
+		textFree(&c->msg);
+	}
+	for(i=0;i<nthreads;i++) pthread_join(th[i],0);
+	if(rpos!=pos) bitseek(br,pos);
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.cond);
+	free(th);
+	free(p.ck);
+}
+
+//position of the first '<', '#' or '/' in text from i to len (len if none),
+//checking 8 characters at a time
+static inline int tagScan(const char* text,int i,int len){
+	const uint64_t ones=0x0101010101010101ULL,high=0x8080808080808080ULL;
+	for(;i+8<=len;i+=8){
+		uint64_t w,a,b,c;
+		memcpy(&w,text+i,8);
+		a=w^(ones*'<');
+		b=w^(ones*'#');
+		c=w^(ones*'/');
+		if((((a-ones)&~a)|((b-ones)&~b)|((c-ones)&~c))&high) break;
+	}
+	while(i<len&&text[i]!='<'&&text[i]!='#'&&text[i]!='/') i++;
+	return i;
+}
+
+//position after the end of the line containing i
+static inline int skipLine(const char* text,int i,int len){
+	const char* q=memchr(text+i,'\n',len-i);
+	return q?q-text+1:len;
+}
+
+//find "<tag>" in text starting from position *pos
+//return the position of "<" and copy tag (without <>) in buf; *pos is moved after the tag
+static int tag(const char* text,int len,int* pos,char* buf,int size){
+	int i=*pos,r,n=0,start;
+	#define nextc() (i<len?(uint8_t)text[i++]:EOF)
+	buf[0]=0;
+	for(r=EOF;r!='<'&&(i=tagScan(text,i,len))<len;){
+		r=nextc();
+		if(r=='#'||(r=='/'&&nextc()=='/')) i=skipLine(text,i,len);	//comment
+	}
+	if(r=='<'){
+		start=i-1;
+		for(r=nextc();r!=EOF&&r!='>'&&n<size-2;r=nextc()) buf[n++]=r;
+		buf[n]=0;
+		*pos=i;
+		if(r=='>') return start;
+	}
+	*pos=i;
+	return -1;
+	#undef nextc
+}
+
+#define TAG_END -1
+#define TAG_NONE 0
+#define TAG_RAW 1
+#define TAG_Y 2
+#define TAG_C 3
+#define TAG_RESTART 4
+#define TAG_DHT 5
+static const char* tagnames[]={"","raw","y","c","restart","dht"};
+
+//find next <tag>...</tag> pair in text starting from position *pos
+//[*start,*end) is set to the tag content and *pos is moved after the closing tag
+//return TAG_xxx type (TAG_NONE for unknown or unmatched tags)
+static int nextTag(const char* text,int len,int* pos,int* start,int* end){
+	char tagbuf[128];
+	int tagstart,tagend,type;
+	tagstart=tag(text,len,pos,tagbuf,sizeof(tagbuf));
+	if(tagstart<0) return TAG_END;
+	for(type=TAG_DHT;type>TAG_NONE&&strcmp(tagbuf,tagnames[type]);type--);
+	if(type==TAG_NONE) return TAG_NONE;
+	tagend=tag(text,len,pos,tagbuf,sizeof(tagbuf));
+	if(tagend<0||tagbuf[0]!='/'||strcmp(tagbuf+1,tagnames[type])) return TAG_NONE;
+	*start=tagstart+strlen(tagnames[type])+2;
+	*end=tagend;
+	return type;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+//high bit of the bytes of w that are >=c (correct up to the first byte >=0x80)
+#define bytesGE(w,c) (((w)+(0x80-(c))*ONES)&HIGHS)
+//high bit of the nonzero bytes of w
+#define bytesNZ(w) (((((w)&~HIGHS)+~HIGHS)|(w))&HIGHS)
+
+//decode 16 hex digits at p in 8 bytes, 8 characters at a time
+//return 16, or the position of the first character that is not a hex digit
+static inline int hex16(const char* p,uint8_t* out){
+	for(int k=0;k<16;k+=8){
+		uint64_t w,u,digit,alpha,bad,nib,x;
+		memcpy(&w,p+k,8);
+		u=w|ONES*0x20;		//lower case
+		digit=bytesGE(w,'0')&~bytesGE(w,'9'+1);
+		alpha=bytesGE(u,'a')&~bytesGE(u,'f'+1);
+		bad=(~(digit|alpha)|w)&HIGHS;
+		if(bad) return k+(__builtin_ctzll(bad)>>3);
+		nib=(w&ONES*0x0F)+(alpha>>7)*9;
+		x=((nib&0x00FF00FF00FF00FFULL)<<4)|((nib>>8)&0x00FF00FF00FF00FFULL);	//pairs of digits
+		x=(x|(x>>8))&0x0000FFFF0000FFFFULL;
+		x=(x|(x>>16))&0xFFFFFFFFULL;
+		for(int j=0;j<4;j++) out[k/2+j]=x>>(j*8);
+	}
+	return 16;
+}
+
+//decode 16 binary digits at p in *x (first digit in the MSB), 8 characters at a time
+//return 16, or the position of the first character that is not '0' or '1'
+static inline int bin16(const char* p,uint32_t* x){
+	*x=0;
+	for(int k=0;k<16;k+=8){
+		uint64_t w,bad;
+		memcpy(&w,p+k,8);
+		bad=bytesNZ((w&~ONES)^(ONES*'0'));
+		if(bad) return k+(__builtin_ctzll(bad)>>3);
+		*x=(*x<<8)|(((w&ONES)*0x8040201008040201ULL)>>56);
+	}
+	return 16;
+}
+
+//convert raw data (len characters) and write it with bit writer bw
+//returns number of extracted bits
+static int parseRaw(struct bitwriter* bw,const char* inbuf,int len){
+//example:
+//0xFFD8FFE1115C45786966000049492A00080000000C000001040001000000200A
+//0b10111010000010011100101110100
+	int s=0,n=0,k,simd=0;	//simd: where digits are decoded 16 at a time again
+	uint8_t xx,c,b[8];
+	uint32_t x;
+	for(int i=0;i<len;i++){
+		if((s==2||s==4)&&i>=simd&&i+16<=len){	//whole bytes of hex or bits
+			k=s==2?hex16(inbuf+i,b):bin16(inbuf+i,&x);
+			if(k==16){
+				if(s==2) for(int j=0;j<8;j++) putbyte(bw,b[j]);
+				else putbits(bw,x,16);
+				n+=s==2?64:16;
+				i+=15;
+				continue;
+			}
+			simd=i+k+1;		//one at a time up to the first non-digit
+		}
+		c=toupper(inbuf[i]);
+		switch(s){
+			case 0:
+				if(c=='0') s=1; //0
+				break;
+			case 1:
+				if(c=='X') s=2;	//0x
+				else if(c=='B') s=4;	//0b
+				else s=0;
+				break;
+			case 2:		//hex 1
+				if((c>='0'&&c<='9')||(c>='A'&&c<='F')){
+					if(c<='9') xx=c-'0';
+					else xx=c-'A'+10;
+					s=3;
+				}
+				else s=0;	// -> 0x
+				break;
+			case 3:		//hex 2
+				if((c>='0'&&c<='9')||(c>='A'&&c<='F')){
+					if(c<='9') xx=(xx<<4)+c-'0';
+					else xx=(xx<<4)+c-'A'+10;
+					s=2;
+				}
+				else s=0;	// -> 0x
+				putbyte(bw,xx);
+				n+=8;
+				break;
+			case 4:		//binary
+				n++;
+				if(c=='0') putbit(bw,0);//printf("0");
+				else if(c=='1') putbit(bw,1);//printf("1");
+				else{
+					s=0;	// -> 0x/0b
+					n--;
+				}
+				break;
+			default:
+				s=0;
+		}
+	}
+	return n;
+}
+
+//read a decimal integer like sscanf("%d") from a text of len characters
+//(out of range values are clamped to 64 bit, then truncated)
+//return the characters read, 0 if there is no number
+static int textDec(const char* p,int len,int* x){
+	int i=0,neg=0,d;
+	uint64_t u=0;
+	while(i<len&&isspace((uint8_t)p[i])) i++;
+	if(i<len&&(p[i]=='-'||p[i]=='+')) neg=p[i++]=='-';
+	if(i>=len||!isdigit((uint8_t)p[i])) return 0;
+	for(;i<len&&isdigit((uint8_t)p[i]);i++){
+		d=p[i]-'0';
+		u=u>(INT64_MAX-d)/10?(uint64_t)INT64_MAX+neg:u*10+d;
+	}
+	*x=neg?(int)(0-u):(int)u;
+	return i;
+}
+
+//read a hex integer like sscanf("%x") from a text of len characters
+//return the characters read, 0 if there is no number
+static int textHex(const char* p,int len,int* x){
+	int i=0,neg=0,d;
+	uint64_t u=0;
+	while(i<len&&isspace((uint8_t)p[i])) i++;
+	if(i<len&&(p[i]=='-'||p[i]=='+')) neg=p[i++]=='-';
+	if(i+2<len&&p[i]=='0'&&(p[i+1]=='x'||p[i+1]=='X')&&isxdigit((uint8_t)p[i+2])) i+=2;
+	if(i>=len||!isxdigit((uint8_t)p[i])) return 0;
+	for(;i<len&&isxdigit((uint8_t)p[i]);i++){
+		d=p[i]<='9'?p[i]-'0':(p[i]|0x20)-'a'+10;
+		u=u>>60?UINT64_MAX:(u<<4)+d;
+	}
+	*x=neg?(int)(0-u):(int)u;
+	return i;
+}
+
+//read the DC coefficient of block content (len characters) in *dc (0 if there is none)
+//return the position of the first non-commented line, *next the position after the DC coefficient
+//(-1 if there is none)
+static int textDC(const char* inbuf,int len,int* dc,int* next){
+//e.g.:
+//[C@0x89C.3] DC:13 AC: -12 1 -1 -2 -2 0 -1 1
+//13 0b11000001101101010001100011011001100
+	int i;
+	uint8_t c;
+	*dc=0;
+	for(i=0;i<len;i++){
+		c=inbuf[i];
+		if(c==' '||c=='\t'||c=='\n') continue;
+		if(c=='/'&&(++i>=len||inbuf[i]!='/')) continue;	//single '/': skip next character
+		if(c=='/'||c=='#'){		//comment
+			const char* q=memchr(inbuf+i,'\n',len-i);
+			i=q?q-inbuf:len;
+			continue;
+		}
+		break;
+	}
+	int m=i<len?textDec(inbuf+i,len-i,dc):0;
+	*next=m?i+m:-1;
+	return i;
+}
+
+//parse block content (len characters), read DC coefficient, encode it with Huffman codes h on bit writer bw
+//return the position of the first non-commented line, *next the position after the DC coefficient
+//(-1 if there is none)
+static int parseDC(struct bitwriter* bw,const char* inbuf,int len,const struct huffenc* h,int* next){
+	int dccoeff;
+	int i=textDC(inbuf,len,&dccoeff,next);
+	//printf("parseDC: len%d i%d dc%d\n",len,i,dccoeff);
+	int e=encodeH(h,dccoeff);
+	int n=e>>24;	//tot bit
+	putbits(bw,e,n);	//MSB first
+	return i;
+}
+
+//return the position after the keyword "ac:" if it follows position i
+//(after blanks) in the block content of len characters, -1 otherwise
+static int acList(const char* inbuf,int len,int i){
+	if(i<0) return -1;
+	while(i<len&&isspace((uint8_t)inbuf[i])) i++;
+	if(i+3>len||(inbuf[i]|0x20)!='a'||(inbuf[i+1]|0x20)!='c'||inbuf[i+2]!=':') return -1;
+	return i+3;
+}
+
+//convert a list of AC coefficients in zigzag order (len characters, e.g. "3 0 -1 0 0 2")
+//to run/size symbols sym and their extra bits val: ZRL for 16 zeros, EOB after the last
+//non-zero coefficient; coefficients after the 63rd are ignored, the ones outside the
+//baseline range (size 10) are clamped to +-1023, the ones without a code in h are
+//taken as 0 (h=0: every symbol has a code); lost[0] and lost[1] count the clamped and
+//the dropped coefficients
+//return the number of symbols (max 64)
+static int acSymbols(const char* inbuf,int len,const struct huffenc* h,uint8_t* sym,uint16_t* val,int* lost){
+	int i=0,k=0,last=0,run=0,ns=0,x,m,n,v;
+	for(;k<63&&(m=textDec(inbuf+i,len-i,&x));i+=m){
+		k++;
+		if(x==0){
+			run++;
+			continue;
+		}
+		if(x>1023||x<-1023){
+			x=x>0?1023:-1023;
+			lost[0]++;
+		}
+		for(v=x>0?x:-x,n=0;v;v>>=1) n++;	//bits required
+		if(h&&(h->len[(run&15)<<4|n]<0||(run>15&&h->len[0xF0]<0))){
+			lost[1]++;
+			run++;
+			continue;
+		}
+		for(;run>15;run-=16){	//ZRL
+			sym[ns]=0xF0;
+			val[ns++]=0;
+		}
+		if(x<0) x+=(1<<n)-1;	//adjust for negative numbers
+		sym[ns]=run<<4|n;
+		val[ns++]=x&((1<<n)-1);
+		run=0;
+		last=k;
+	}
+	if(last<63&&(!h||h->len[0]>=0)){	//EOB
+		sym[ns]=0;
+		val[ns++]=0;
+	}
+	return ns;
+}
+
+//write n symbols sym with their extra bits val using Huffman codes h
+//return the number of bits written
+static int putSymbols(struct bitwriter* bw,const struct huffenc* h,const uint8_t* sym,const uint16_t* val,int n){
+	int bits=0;
+	for(int i=0;i<n;i++){
+		putbits(bw,h->code[sym[i]],h->len[sym[i]]);
+		putbits(bw,val[i],sym[i]&15);
+		bits+=h->len[sym[i]]+(sym[i]&15);
+	}
+	return bits;
+}
+
+//parse a list of AC coefficients (len characters) and encode it with Huffman codes h
+//(lost: see acSymbols)
+//return the number of bits written
+static int parseAC(struct bitwriter* bw,const char* inbuf,int len,const struct huffenc* h,int* lost){
+	uint8_t sym[64];
+	uint16_t val[64];
+	return putSymbols(bw,h,sym,val,acSymbols(inbuf,len,h,sym,val,lost));
+}
+
+//log the coefficients acSymbols clamped or dropped (lost) in the block tag content
+//inbuf (len characters), named by its //[Y@0x...] address or else by its number
+static void logLost(FILE* log,const char* inbuf,int len,int block,const int* lost){
+	const char* p=memchr(inbuf,'[',len);
+	const char* q=p?memchr(p,']',inbuf+len-p):0;
+	char name[32];
+	if(!lost[0]&&!lost[1]) return;
+	if(q&&q-p<(int)sizeof(name)) snprintf(name,sizeof(name),"%.*s",(int)(q-p-1),p+1);
+	else snprintf(name,sizeof(name),"%d",block);
+	if(lost[0]) logPrintf(log,"block %s: %d AC coefficient(s) clamped to +-1023\n",name,lost[0]);
+	if(lost[1]) logPrintf(log,"block %s: %d AC coefficient(s) without a Huffman code dropped\n",name,lost[1]);
+}
+
+//parse <dht> content (len characters) and replace the table of ht it names:
+//name and a list of [length prefix code]
+static void parseDHT(struct hufftables* ht,const char* inbuf,int len){
+	int (*HTX)[3]=0;
+	int i=0,n,j=0;
+	while(i<len&&isspace((uint8_t)inbuf[i])) i++;
+	for(n=0;i+n<len&&n<127&&!isspace((uint8_t)inbuf[i+n]);n++);
+	if(n==3&&!memcmp(inbuf+i,"YDC",3)) HTX=ht->YDC; 
+	if(n==3&&!memcmp(inbuf+i,"YAC",3)) HTX=ht->YAC;
+	if(n==3&&!memcmp(inbuf+i,"CDC",3)) HTX=ht->CDC;
+	if(n==3&&!memcmp(inbuf+i,"CAC",3)) HTX=ht->CAC;
+	if(!HTX) return;
+	for(i=0;i<len&&j<256;i=n+1){	//text between brackets
+		int x[3],k,m,r=i;
+		for(n=i;n<len&&inbuf[n]!='['&&inbuf[n]!=']';n++);
+		for(k=0;k<3&&(m=textHex(inbuf+r,n-r,x+k));k++) r+=m;
+		if(k==3){
+			//printf("[%X %X %X]",x[0],x[1],x[2]);
+			HTX[j][0]=x[0];
+			HTX[j][1]=x[1];
+			HTX[j][2]=x[2];
+			j++;
+		}
+	}
+	HTX[j][0]=-1;
+	HTX[j][1]=-1;
+	HTX[j][2]=-1;
+	//printf("\n");
+}
+
+//encoder context: Huffman tables, changed by <dht> tags
+struct encoder{
+	struct hufftables ht;
+	struct huffenc YDC,YAC,CDC,CAC;	//codes by symbol, rebuilt when ht changes
+	int YAC_EOB_I,CAC_EOB_I;	//EOB code index in AC tables
+	FILE* log;				//messages (0: none)
+	int format;				//FORMAT_TEXT or FORMAT_BIN input
+	int optimize;			//1: build optimal Huffman tables
+	FILE* base;				//jpeg the text was decoded from, to splice the edited blocks into (0: none)
+	FILE* baseidx;			//and its index (0: none)
+};
+
+//build the codes by symbol from the Huffman tables of e
+static void encoderTables(struct encoder* e){
+	huffencInit(&e->YDC,e->ht.YDC);
+	huffencInit(&e->YAC,e->ht.YAC);
+	huffencInit(&e->CDC,e->ht.CDC);
+	huffencInit(&e->CAC,e->ht.CAC);
+}
+
+//return a new encoder with default tables, 0 if they have no EOB code
+struct encoder* encoderNew(){
+	struct encoder* e=calloc(1,sizeof(struct encoder));
+	if(!e) return 0;
+	hufftablesInit(&e->ht);
+	e->YAC_EOB_I=e->CAC_EOB_I=-1;
+	for(int i=0;e->YAC_EOB_I==-1&&e->ht.YAC[i][2]!=-1;i++) if(e->ht.YAC[i][2]==0) e->YAC_EOB_I=i;		//EOB code
+	for(int i=0;e->CAC_EOB_I==-1&&e->ht.CAC[i][2]!=-1;i++) if(e->ht.CAC[i][2]==0) e->CAC_EOB_I=i;		//EOB code
+	//printf("Y eob: %d %X %X\n",e->ht.YAC[e->YAC_EOB_I][0],e->ht.YAC[e->YAC_EOB_I][1],e->ht.YAC[e->YAC_EOB_I][2]);
+	if(e->YAC_EOB_I==-1||e->CAC_EOB_I==-1){
+		free(e);
+		return 0;
+	}
+	encoderTables(e);
+	e->log=stdout;
+	return e;
+}
+
+void encoderLog(struct encoder* e,FILE* log){
+	e->log=log;
+}
+
+void encoderFormat(struct encoder* e,int format){
+	e->format=format;
+}
+
+void encoderOptimize(struct encoder* e,int optimize){
+	e->optimize=optimize;
+}
+
+void encoderBase(struct encoder* e,FILE* base,FILE* idx){
+	e->base=base;
+	e->baseidx=idx;
+}
+
+void encoderFree(struct encoder* e){
+	free(e);
+}
+
+//state of the encoding of (part of) a text
+struct encstate{
+	struct encoder* enc;
+	struct bitwriter bw;
+	int skipdht;				//1: <dht> tags already applied
+	int Nraw,Ny,Nc;				//segment count
+	int quiet;					//1: trial encoding, don't log the block messages
+};
+
+//encode the content (len characters) of a block tag of type TAG_Y or TAG_C with the bit writer of e
+static void encodeBlock(struct encstate* e,int type,const char* inbuf,int len){
+	struct bitwriter* bw=&e->bw;
+	struct encoder* enc=e->enc;
+	int (*AC)[3]=type==TAG_Y?enc->ht.YAC:enc->ht.CAC;
+	int EOB_I=type==TAG_Y?enc->YAC_EOB_I:enc->CAC_EOB_I;
+	int lost[2]={0,0};
+	int q,p=parseDC(bw,inbuf,len,type==TAG_Y?&enc->YDC:&enc->CDC,&q);
+	int n=(q=acList(inbuf,len,q))>=0?parseAC(bw,inbuf+q,len-q,type==TAG_Y?&enc->YAC:&enc->CAC,lost):parseRaw(bw,inbuf+p,len-p);
+	if(n==0&&EOB_I!=-1) putbits(bw,AC[EOB_I][1],AC[EOB_I][0]);	//no AC data: EOB code
+	if(!e->quiet) logLost(enc->log,inbuf,len,e->Ny+e->Nc-1,lost);
+}
+
+//encode text from position pos to len with the bit writer of e
+static void encodeText(struct encstate* e,const char* text,int len,int pos){
+	struct bitwriter* bw=&e->bw;
+	struct encoder* enc=e->enc;
+	struct hufftables* ht=&enc->ht;
+	int type,start,end;
+	while((type=nextTag(text,len,&pos,&start,&end))!=TAG_END){
+		if(type==TAG_NONE||(type==TAG_DHT&&e->skipdht)) continue;
+		const char* inbuf=text+start;	//tag content, not copied
+		int taglen=end-start;
+		if(type==TAG_RAW){		//<raw>
+			e->Nraw++;
+			//printf("R-->%s<--\n",inbuf);
+			parseRaw(bw,inbuf,taglen);
+		}
+		else if(type==TAG_Y||type==TAG_C){		//<y> <c>
+			if(type==TAG_Y) e->Ny++;
+			else e->Nc++;
+			encodeBlock(e,type,inbuf,taglen);
+		}
+		else if(type==TAG_RESTART){		//<restart>
+			int res_marker=0;
+			textDec(inbuf,taglen,&res_marker);
+			putbit(bw,-1);	//fill byte
+			putbyte(bw,0xFF);
+			putbyte(bw,0xD0+res_marker);
+		}
+		else if(type==TAG_DHT){		//<dht>
+			parseDHT(ht,inbuf,taglen);
+			encoderTables(enc);
+		}
+	}
+}
+
+//encode the records of a binary container (data, size bytes) with the bit writer of e,
+//in the order of its segment table
+//return 0 or -1 if the container is not valid
+static int encodeBin(struct encstate* e,const uint8_t* data,size_t size){
+	struct bitwriter* bw=&e->bw;
+	struct hufftables* ht=&e->enc->ht;
+	int YAC_EOB_I=e->enc->YAC_EOB_I,CAC_EOB_I=e->enc->CAC_EOB_I;
+	if(size<BIN_HEADSIZE||memcmp(data,"JDCB",4)||binGet(data+4,2)!=BIN_VERSION) return -1;
+	size_t nseg=binGet(data+8,4),segoff=binGet(data+16,8);
+	if(segoff>size||nseg>(size-segoff)/16) return -1;
+	for(size_t i=0;i<nseg;i++){
+		const uint8_t* sg=data+segoff+16*i;
+		size_t count=sg[0]==BIN_BLOCKS?binGet(sg+4,4):1;
+		size_t o=binGet(sg+8,8),len;
+		for(;count;count--,o+=len){
+			if(o<BIN_HEADSIZE||o>segoff||segoff-o<7) return -1;	//records are before the tables
+			const uint8_t* p=data+o;
+			len=binRecordLen(p);
+			if(len==0||len>segoff-o) return -1;
+			if(p[0]==BIN_RAW){
+				e->Nraw++;
+				for(size_t k=5;k<len;k++) putbyte(bw,p[k]);
+			}
+			else if(p[0]==BIN_Y||p[0]==BIN_C){
+				struct huffenc* DC=p[0]==BIN_Y?&e->enc->YDC:&e->enc->CDC;
+				int (*AC)[3]=p[0]==BIN_Y?ht->YAC:ht->CAC;
+				int eob=p[0]==BIN_Y?YAC_EOB_I:CAC_EOB_I;
+				int n=binGet(p+5,2);
+				int x=encodeH(DC,(int32_t)binGet(p+1,4));
+				if(p[0]==BIN_Y) e->Ny++;
+				else e->Nc++;
+				putbits(bw,x,x>>24);
+				for(p+=7;n>=8;n-=8) putbits(bw,*p++,8);
+				if(n) putbits(bw,*p>>(8-n),n);
+				if(len==7) putbits(bw,AC[eob][1],AC[eob][0]);	//no AC data: EOB code
+			}
+			else if(p[0]==BIN_RESTART){
+				putbit(bw,-1);	//fill byte
+				putbyte(bw,0xFF);
+				putbyte(bw,0xD0+p[1]);
+			}
+			else if(p[0]==BIN_DHT){
+				int (*HTX)[3]=p[1]==0?ht->YDC:p[1]==1?ht->YAC:p[1]==2?ht->CDC:p[1]==3?ht->CAC:0;
+				int n=binGet(p+2,2);
+				if(!HTX||n>256) return -1;
+				for(int k=0;k<n*3;k++) HTX[k/3][k%3]=(int32_t)binGet(p+4+4*k,4);
+				HTX[n][0]=HTX[n][1]=HTX[n][2]=-1;
+				encoderTables(e->enc);
+			}
+		}
+	}
+	return 0;
+}
+
+//append the k bits of x (k<=16) to bits at bit position n (MSB first)
+static inline void appendBits(uint8_t* bits,int n,uint32_t x,int k){
+	uint32_t w=x<<(32-k)>>(n&7);
+	uint8_t* p=bits+(n>>3);
+	p[0]=(n&7?p[0]:0)|w>>24;
+	p[1]=w>>16;
+	p[2]=w>>8;
+}
+
+//collect the bits of the 0b literals of block content (len characters) in bits, MSB first,
+//as parseRaw would write them (bits needs 4 bytes more than max bits, they are left to 0)
+//return their number, -1 if there are hex literals or more than max bits
+static int textBits(const char* inbuf,int len,uint8_t* bits,int max){
+	int s=0,n=0,k,simd=0;	//simd: where digits are read 16 at a time again
+	uint32_t x;
+	for(int i=0;i<len;i++){
+		if(s==2&&i>=simd&&i+16<=len){
+			if((k=bin16(inbuf+i,&x))==16){
+				if(n+16>max) return -1;
+				appendBits(bits,n,x,16);
+				n+=16;
+				i+=15;
+				continue;
+			}
+			simd=i+k+1;
+		}
+		uint8_t c=toupper(inbuf[i]);
+		if(s==0) s=c=='0';
+		else if(s==1) s=c=='B'?2:c=='X'?3:0;
+		else if(s==2&&(c=='0'||c=='1')){
+			if(n==max) return -1;
+			appendBits(bits,n++,c-'0',1);
+		}
+		else if(s==3&&isxdigit(c)) return -1;
+		else s=0;
+	}
+	memset(bits+(n>>3)+1,0,3);
+	if((n&7)==0) bits[n>>3]=0;
+	return n;
+}
+
+//read k bits (k<=16) at bit position p of bits (0 after the end)
+static inline int peekArray(const uint8_t* bits,int p,int k){
+	const uint8_t* q=bits+(p>>3);
+	uint32_t w=((uint32_t)q[0]<<24|q[1]<<16|q[2]<<8)<<(p&7);
+	return k?w>>(32-k):0;
+}
+
+//split the AC bits of a block (nbits bits, MSB first, 0 after the end) in symbols sym and their extra bits val
+//using Huffman lookup table h; the block ends like in decodeBlock, at EOB or after 63 coefficients
+//return the number of symbols (max 64), -1 if the bits are not exactly a whole block
+static int blockSymbols(const uint8_t* bits,int nbits,const struct huffLUT* h,uint8_t* sym,uint16_t* val){
+	int p=0,ns=0,ncoeff=1,s=0,n,k;
+	while(ncoeff<64){
+		k=peekArray(bits,p,HUFF_FASTBITS);
+		n=h->fastlen[k];
+		if(n) s=h->fastsym[k];
+		else for(n=HUFF_FASTBITS+1;n<=16;n++){
+			if((k=huffSearch(h,n,peekArray(bits,p,n)))>=0){
+				s=h->sym[k];
+				break;
+			}
+		}
+		k=s&0xF;	//extra bits
+		if(n>16||p+n+k>nbits) return -1;
+		sym[ns]=s;
+		val[ns++]=peekArray(bits,p+n,k);
+		p+=n+k;
+		if(s==0) break;		//EOB
+		ncoeff+=s==0xF0?16:(s>>4)+1;
+	}
+	return p==nbits?ns:-1;
+}
+
+//build an optimal Huffman table with codes up to 16 bit for the symbol counts freq
+//(ISO/IEC 10918-1 Annex K.2): bits[i] codes of length i+1 for the symbols in huffval
+//return the number of symbols
+static int optimalTable(const uint32_t freq[256],uint8_t bits[16],uint8_t huffval[256]){
+	uint64_t f[257];
+	int codesize[257],others[257],count[258];
+	int i,j,c1,c2,n=0;
+	for(i=0;i<256;i++) f[i]=freq[i];
+	f[256]=1;		//reserved, so that no code is all 1 bits
+	for(i=0;i<257;i++){
+		codesize[i]=0;
+		others[i]=-1;
+	}
+	//Figure K.1: merge the two least frequent symbols (the highest one on a tie)
+	for(;;){
+		for(c1=-1,i=0;i<257;i++) if(f[i]&&(c1<0||f[i]<=f[c1])) c1=i;
+		for(c2=-1,i=0;i<257;i++) if(f[i]&&i!=c1&&(c2<0||f[i]<=f[c2])) c2=i;
+		if(c2<0) break;
+		f[c1]+=f[c2];
+		f[c2]=0;
+		for(codesize[c1]++;others[c1]>=0;codesize[c1]++) c1=others[c1];
+		others[c1]=c2;
+		for(codesize[c2]++;others[c2]>=0;codesize[c2]++) c2=others[c2];
+	}
+	memset(count,0,sizeof(count));
+	for(i=0;i<257;i++) count[codesize[i]]++;
+	//Figure K.3: limit code length to 16 bit
+	for(i=256;i>16;i--){
+		while(count[i]>0){
+			for(j=i-2;count[j]==0;j--);
+			count[i]-=2;
+			count[i-1]++;
+			count[j+1]+=2;
+			count[j]--;
+		}
+	}
+	for(i=16;count[i]==0;i--);
+	count[i]--;		//remove the reserved code
+	if(count[1]){	//the decoder reads codes of at least 2 bits
+		count[1]--;
+		count[2]++;
+	}
+	for(i=0;i<16;i++) bits[i]=count[i+1];
+	//Figure K.4: symbols by code length
+	for(i=1;i<=256;i++) for(j=0;j<256;j++) if(codesize[j]==i) huffval[n++]=j;
 	return n;
 }
 
-//parse buffer, read DC coefficient, encode it with Huffman table Htable, save on file f
-//return the position of the first non-commented line
-char* parseDC(char* inbuf,int Htable[][3],FILE* f){
-//e.g.:
-//[C@0x89C.3] DC:13 AC: -12 1 -1 -2 -2 0 -1 1
-//13 0b11000001101101010001100011011001100
-	int s=0,i=0,dccoeff=0;
-	uint8_t xx,c;
-	int len=strlen(inbuf);
-	for(i=0;i<len;i++){
-		c=inbuf[i];
-		if(s==0){
-			if(c==' '||c=='\t'||c=='\n') s=0;
-			else if(c=='/') s=1;
-			else if(c=='#') s=2;
+//state of an -optimize pass over a text
+struct optstate{
+	uint32_t freq[4][256];		//symbol counts for YDC YAC CDC CAC
+	struct huffenc code[4];		//optimized codes
+	uint8_t dht[4*(4+17+256)];	//DHT segments with the optimized tables
+	int dhtlen;
+	const char* err;			//why the text can't be re-coded
+};
+
+//build optimized tables from the symbol counts of o and a DHT segment for each
+//(classes without symbols are left out; one table per segment, as -decode lists them)
+static void optimizeTables(struct optstate* o){
+	static const uint8_t id[4]={0x00,0x10,0x01,0x11};	//DHT class and destination
+	uint8_t* p=o->dht;
+	for(int c=0;c<4;c++){
+		int rows[257][3],i,j,k,code=0,n;
+		memset(rows,-1,sizeof(rows));
+		for(i=0;i<256&&o->freq[c][i]==0;i++);
+		if(i<256){
+			n=optimalTable(o->freq[c],p+5,p+21);
+			p[0]=0xFF;
+			p[1]=0xC4;
+			p[2]=(n+19)>>8;
+			p[3]=n+19;
+			p[4]=id[c];
+			//Figure C.2: codes in order of length
+			for(i=k=0;i<16;i++,code<<=1){
+				for(j=0;j<p[5+i];j++,k++,code++){
+					rows[k][0]=i+1;
+					rows[k][1]=code;
+					rows[k][2]=p[21+k];
+				}
+			}
+			p+=21+n;
+		}
+		huffencInit(&o->code[c],rows);
+	}
+	o->dhtlen=p-o->dht;
+}
+
+//copy jpeg header p (len bytes) to bw (if not 0), replacing its DHT segments
+//with the ones of o, put before SOS
+//return 0, -1 if the header doesn't end with a SOS segment
+static int optimizeHeader(const uint8_t* p,int len,struct optstate* o,struct bitwriter* bw){
+	int i=0,k,seg;
+	while(i+1<len){
+		if(p[i]!=0xFF) return -1;
+		k=p[i+1];
+		if(k==0xFF||k==0xD8||k==0x01||(k>=0xD0&&k<=0xD7)) seg=k==0xFF?1:2;	//fill byte or no segment
+		else if(i+3<len) seg=2+(p[i+2]<<8|p[i+3]);
+		else return -1;
+		if(k==0xDA){
+			if(bw){
+				for(k=0;k<o->dhtlen;k++) putbyte(bw,o->dht[k]);
+				for(;i<len;i++) putbyte(bw,p[i]);
+			}
+			return 0;
+		}
+		if(i+seg>len) return -1;
+		if(bw&&k!=0xC4) for(k=0;k<seg;k++) putbyte(bw,p[i+k]);
+		i+=seg;
+	}
+	return -1;
+}
+
+//-optimize: read the symbols of all blocks of a text (write=0: count them in o->freq)
+//and encode them with the codes of o; the <raw> tags before the first block are the header,
+//where the DHT segments are replaced
+//return 0, -1 with the reason in o->err if the text can't be re-coded without changes
+static int optimizeText(struct encstate* e,const char* text,int len,struct optstate* o,int write){
+	struct bitwriter* bw=write?&e->bw:0;
+	struct hufftables* ht=&e->enc->ht;
+	struct huffLUT lut[2];			//YAC, CAC tables of the text
+	struct bitwriter hdr;
+	uint8_t bits[1024+4],sym[64];
+	uint16_t val[64];
+	int type,start=0,end=0,pos=0,header=1,r=0;
+	hufftablesInit(ht);
+	buildHuffLUT(ht->YAC,lut);
+	buildHuffLUT(ht->CAC,lut+1);
+	writerInit(&hdr,0);
+	while(r==0){
+		type=nextTag(text,len,&pos,&start,&end);
+		const char* inbuf=text+start;
+		int taglen=end-start;
+		if(type==TAG_NONE) continue;
+		if(type==TAG_DHT){		//tables of the AC bits that follow
+			parseDHT(ht,inbuf,taglen);
+			buildHuffLUT(ht->YAC,lut);
+			buildHuffLUT(ht->CAC,lut+1);
+			continue;
+		}
+		if(type==TAG_RAW&&header){
+			parseRaw(&hdr,inbuf,taglen);
+			if(bw) e->Nraw++;
+			continue;
+		}
+		if(header){
+			header=0;
+			putbit(&hdr,-1);
+			if(optimizeHeader(hdr.buf,hdr.len,o,bw)){
+				o->err="the <raw> header doesn't end with a SOS segment";
+				r=-1;
+				break;
+			}
+		}
+		if(type==TAG_END) break;
+		if(type==TAG_RAW){
+			if(bw){
+				parseRaw(bw,inbuf,taglen);
+				e->Nraw++;
+			}
+		}
+		else if(type==TAG_RESTART){
+			if(bw){
+				int res_marker=0;
+				textDec(inbuf,taglen,&res_marker);
+				putbit(bw,-1);	//fill byte
+				putbyte(bw,0xFF);
+				putbyte(bw,0xD0+res_marker);
+			}
+		}
+		else if(type==TAG_Y||type==TAG_C){
+			int c=type==TAG_Y?0:2;		//DC table, AC is c+1
+			int dc,q,n,ns,size,lost[2]={0,0};
+			int p=textDC(inbuf,taglen,&dc,&q);
+			for(n=dc>0?dc:-dc,size=0;n;n>>=1) size++;	//DC size
+			if(size>11){
+				o->err="DC value out of range";
+				r=-1;
+				break;
+			}
+			if((q=acList(inbuf,taglen,q))>=0) ns=acSymbols(inbuf+q,taglen-q,0,sym,val,lost);
+			else if((n=textBits(inbuf+p,taglen-p,bits,1024*8))>0) ns=blockSymbols(bits,n,lut+c/2,sym,val);
+			else if(n==0){		//no AC data: EOB
+				sym[0]=val[0]=0;
+				ns=1;
+			}
+			else{
+				o->err="hex data or too many bits in a block";
+				r=-1;
+				break;
+			}
+			if(ns<0){
+				o->err="AC bits that are not a whole block";
+				r=-1;
+				break;
+			}
+			if(bw){
+				int x=encodeH(&o->code[c],dc);
+				putbits(bw,x,x>>24);
+				putSymbols(bw,&o->code[c+1],sym,val,ns);
+				logLost(e->enc->log,inbuf,taglen,e->Ny+e->Nc,lost);
+				if(type==TAG_Y) e->Ny++;
+				else e->Nc++;
+			}
+			else{
+				o->freq[c][size]++;
+				for(int i=0;i<ns;i++) o->freq[c+1][sym[i]]++;
+			}
+		}
+	}
+	writerFree(&hdr);
+	return r;
+}
+
+//text segment encoded by a worker thread
+struct segment{
+	int start,end;		//text positions
+	int last;			//1: add EOI marker
+	struct encstate e;
+	uint8_t* buf;		//encoded data
+	size_t len;
+	int done;
+};
+
+//shared state of the encoder threads
+struct segmentpool{
+	struct segment* sg;
+	int n;				//number of segments
+	int next;			//next segment to encode
+	int written;		//segments already written
+	int window;			//max segments encoded ahead of written ones
+	const char* text;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void* segmentWorker(void* arg){
+	struct segmentpool* p=arg;
+	struct segment* sg;
+	for(;;){
+		pthread_mutex_lock(&p->lock);
+		while(p->next<p->n&&p->next>=p->written+p->window) pthread_cond_wait(&p->cond,&p->lock);
+		if(p->next>=p->n){
+			pthread_mutex_unlock(&p->lock);
+			return 0;
+		}
+		sg=p->sg+p->next++;
+		pthread_mutex_unlock(&p->lock);
+		struct bitwriter* bw=&sg->e.bw;
+		writerInit(bw,0);
+		encodeText(&sg->e,p->text,sg->end,sg->start);
+		if(sg->last){
+			putbit(bw,-1);	//fill byte with 1
+			putbyte(bw,0xFF);
+			putbyte(bw,0xD9);
+		}
+		sg->buf=bw->buf;
+		sg->len=bw->len;
+		pthread_mutex_lock(&p->lock);
+		sg->done=1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+//encode text using nthreads threads and write the result to file f2
+//the text is split after every <restart> tag and the segments are encoded in parallel;
+//<dht> tags must come before any block or restart, otherwise return 0 and let the
+//caller encode serially
+static int encodeTextParallel(struct encstate* e,const char* text,int len,FILE* f2,int nthreads){
+	struct segmentpool p;
+	int pos=0,type,start,end,blocks=0,n=0,size=256,i,k;
+	int* split=malloc(size*sizeof(int));
+	split[n++]=0;
+	while((type=nextTag(text,len,&pos,&start,&end))!=TAG_END){
+		if(type==TAG_DHT){
+			if(blocks){	//table changed between blocks
+				free(split);
+				return 0;
+			}
+			parseDHT(&e->enc->ht,text+start,end-start);
+			encoderTables(e->enc);
+		}
+		else if(type!=TAG_NONE&&type!=TAG_RAW) blocks=1;
+		if(type==TAG_RESTART){
+			if(n==size) split=realloc(split,(size*=2)*sizeof(int));
+			split[n++]=pos;
+		}
+	}
+	memset(&p,0,sizeof(p));
+	p.sg=calloc(n,sizeof(struct segment));
+	for(k=0;k<n;k++){
+		p.sg[k].start=split[k];
+		p.sg[k].end=k<n-1?split[k+1]:len;
+		p.sg[k].last=k==n-1;
+		p.sg[k].e=*e;
+		p.sg[k].e.skipdht=1;
+	}
+	free(split);
+	p.n=n;
+	p.window=4*nthreads;
+	p.text=text;
+	pthread_mutex_init(&p.lock,0);
+	pthread_cond_init(&p.cond,0);
+	pthread_t* th=malloc(nthreads*sizeof(pthread_t));
+	for(i=0;i<nthreads;i++) pthread_create(th+i,0,segmentWorker,&p);
+	for(k=0;k<n;k++){
+		struct segment* sg=p.sg+k;
+		pthread_mutex_lock(&p.lock);
+		while(!sg->done) pthread_cond_wait(&p.cond,&p.lock);
+		pthread_mutex_unlock(&p.lock);
+		fwrite(sg->buf,1,sg->len,f2);
+		free(sg->buf);
+		e->Nraw+=sg->e.Nraw;
+		e->Ny+=sg->e.Ny;
+		e->Nc+=sg->e.Nc;
+		pthread_mutex_lock(&p.lock);
+		p.written=k+1;
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+	}
+	for(i=0;i<nthreads;i++) pthread_join(th[i],0);
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.cond);
+	free(th);
+	free(p.sg);
+	return 1;
+}
+
+//write the analysis of scan s as JSON to f: image size, error counts, restart
+//marker chains and the errors of every damaged MCU;
+//with d->heatmap also write a PGM image with a pixel per MCU (0: no error,
+//brighter for worse errors, 255 for MCUs not found)
+static void analyzeReport(const struct decoder* d,FILE* f,struct scanstate* s,int X,int Y,int My){
+	static const uint8_t level[5]={255,192,160,224,128};	//heatmap level by kind of error
+	int Mx=s->Mx,n=0,i,k,m;
+	int nmcu=s->flagsize<s->mcucount?s->flagsize:s->mcucount;
+	for(m=0;m<nmcu;m++) n+=s->flags[m]!=0;
+	fprintf(f,"{\n\"width\":%d,\"height\":%d,\"mcu\":\"%s\",\"mcu_x\":%d,\"mcu_y\":%d,\n",X,Y,d->MCUdef,Mx,My);
+	fprintf(f,"\"mcu_expected\":%d,\"mcu_found\":%d,\"restart_interval\":%d,\n",Mx*My,s->mcucount,d->restartInt);
+	fprintf(f,"\"errors\":{");
+	for(k=0;k<5;k++) fprintf(f,"%s\"%s\":%d",k?",":"",mcuflagnames[k],s->nflag[k]);
+	fprintf(f,"},\n\"missing_restart_markers\":[");
+	for(i=1,k=0;d->restartInt>0&&i<50;i++) if(s->rstErrStat[i]) fprintf(f,"%s[%d,%d]",k++?",":"",i,s->rstErrStat[i]);
+	fprintf(f,"],\n\"damaged_mcu\":%d,\n\"damaged\":[",n);
+	for(m=0,n=0;m<nmcu;m++){
+		if(!s->flags[m]) continue;
+		fprintf(f,"%s\n{\"mcu\":%d,\"x\":%d,\"y\":%d,\"errors\":[",n++?",":"",m,m%Mx,m/Mx);
+		for(k=0,i=0;k<5;k++) if(s->flags[m]>>k&1) fprintf(f,"%s\"%s\"",i++?",":"",mcuflagnames[k]);
+		fprintf(f,"]}");
+	}
+	fprintf(f,"\n]\n}\n");
+	if(d->heatmap){
+		int rows=My>0?My:(s->mcucount+Mx-1)/Mx;
+		uint8_t* row=malloc(Mx);
+		fprintf(d->heatmap,"P5\n%d %d\n255\n",Mx,rows);
+		for(int y=0;y<rows;y++){
+			for(int x=0;x<Mx;x++){
+				m=y*Mx+x;
+				row[x]=m>=s->mcucount?255:0;
+				for(k=0;m<nmcu&&k<5;k++) if(s->flags[m]>>k&1&&level[k]>row[x]) row[x]=level[k];
+			}
+			fwrite(row,1,Mx,d->heatmap);
+		}
+		free(row);
+	}
+}
+
+//FORMAT_RENDER: the coefficients of every block are dequantized, transformed
+//by an integer AAN IDCT, the chroma is upsampled by the sampling factors and
+//converted to RGB; MCU rows are reconstructed in parallel
+//FORMAT_THUMB: the same at 1/8 scale from the DC values, a pixel per block
+#define IDCT_PASS1 2		//fraction bits of the dequantized coefficients
+typedef int32_t v8si __attribute__((vector_size(32)));	//8 lanes: 8 columns (or rows) at a time
+
+//natural order position of the coefficients in zigzag order
+static const uint8_t zigzag[64]={
+	0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,
+	35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63};
+
+//1-D AAN IDCT of p[0..7] (frequencies to samples), every lane independent,
+//constants with 8 fraction bits
+static inline void idct8(v8si* p){
+	v8si t10=p[0]+p[4],t11=p[0]-p[4],t13=p[2]+p[6];
+	v8si t12=((p[2]-p[6])*362>>8)-t13;
+	v8si e0=t10+t13,e3=t10-t13,e1=t11+t12,e2=t11-t12;
+	v8si z13=p[5]+p[3],z10=p[5]-p[3],z11=p[1]+p[7],z12=p[1]-p[7];
+	v8si o7=z11+z13;
+	v8si o11=(z11-z13)*362>>8;
+	v8si z5=(z10+z12)*473>>8;
+	v8si o10=(z12*277>>8)-z5;
+	v8si o12=(z10*-669>>8)+z5;
+	v8si o6=o12-o7,o5=o11-o6,o4=o10+o5;
+	p[0]=e0+o7;
+	p[7]=e0-o7;
+	p[1]=e1+o6;
+	p[6]=e1-o6;
+	p[2]=e2+o5;
+	p[5]=e2-o5;
+	p[4]=e3+o4;
+	p[3]=e3-o4;
+}
+
+//dequantize block c (zigzag order) with q (AAN scaled, zigzag order) and write
+//its 8x8 samples to out, stride bytes per row
+static void idctBlock(const int16_t* c,const int32_t* q,uint8_t* out,int stride){
+	int32_t w[64];
+	v8si v[8];
+	for(int k=0;k<64;k++){
+		int x=c[k]*q[k];
+		w[zigzag[k]]=x<-32768?-32768:x>32767?32767:x;	//no overflow on damaged blocks
+	}
+	memcpy(v,w,sizeof(v));
+	idct8(v);					//columns
+	memcpy(w,v,sizeof(v));
+	for(int i=0;i<8;i++){		//transpose
+		for(int j=0;j<8;j++) v[i][j]=w[j*8+i];
+	}
+	idct8(v);					//rows
+	for(int x=0;x<8;x++){
+		for(int y=0;y<8;y++){
+			int s=((v[x][y]+(1<<(IDCT_PASS1+2)))>>(IDCT_PASS1+3))+128;
+			out[y*stride+x]=s<0?0:s>255?255:s;
+		}
+	}
+}
+
+//image component
+struct rendercomp{
+	int h,v;			//sampling factors
+	int first;			//first block in the MCU
+	int32_t q[64];		//dequantization table, AAN scaled
+	int* xmap;			//sample column of every pixel column
+};
+
+struct renderpool{
+	const int16_t* coef;
+	int ncoef;			//MCUs with coefficients
+	int scale;			//samples per block side: 8, or 1 with DC values only
+	struct rendercomp comp[3];
+	int ncomp,mculen;
+	int X,Y,Mx,My,mcuw,mcuh;
+	uint8_t* rgb;		//output image
+	int crr[256],cbb[256],crg[256],cbg[256];	//JFIF YCbCr to RGB terms by chroma value
+	uint8_t limit[1024];	//0..255 clamp of values -384..639
+	int next;			//next MCU row
+	pthread_mutex_t lock;
+};
+
+//reconstruct MCU row r into the RGB image
+static void renderRow(struct renderpool* p,int r){
+	uint8_t* plane[3];
+	int w[3],i,x,y,n=p->scale,bsize=n*n;
+	for(i=0;i<p->ncomp;i++){
+		struct rendercomp* c=p->comp+i;
+		w[i]=p->Mx*c->h*n;
+		plane[i]=malloc(w[i]*c->v*n);
+		memset(plane[i],128,w[i]*c->v*n);	//MCUs not found: gray
+		for(int m=0;m<p->Mx;m++){
+			int mcu=r*p->Mx+m;
+			if(mcu>=p->ncoef) break;
+			const int16_t* b=p->coef+((int64_t)mcu*p->mculen+c->first)*bsize;
+			for(int k=0;k<c->h*c->v;k++,b+=bsize){
+				uint8_t* o=plane[i]+(k/c->h)*n*w[i]+(m*c->h+k%c->h)*n;
+				if(n==8) idctBlock(b,c->q,o,w[i]);
+				else{		//the mean of the block samples
+					int s=((b[0]*c->q[0]+(1<<(IDCT_PASS1+2)))>>(IDCT_PASS1+3))+128;
+					*o=s<0?0:s>255?255:s;
+				}
+			}
+		}
+	}
+	for(y=0;y<p->mcuh&&r*p->mcuh+y<p->Y;y++){
+		uint8_t* out=p->rgb+(int64_t)(r*p->mcuh+y)*p->X*3;
+		const uint8_t* Yrow=plane[0]+y*p->comp[0].v*n/p->mcuh*w[0];
+		if(p->ncomp==1){
+			for(x=0;x<p->X;x++,out+=3) out[0]=out[1]=out[2]=Yrow[p->comp[0].xmap[x]];
+			continue;
+		}
+		const uint8_t* Cbrow=plane[1]+y*p->comp[1].v*n/p->mcuh*w[1];
+		const uint8_t* Crrow=plane[2]+y*p->comp[2].v*n/p->mcuh*w[2];
+		const uint8_t* limit=p->limit+384;
+		for(x=0;x<p->X;x++,out+=3){
+			int l=Yrow[p->comp[0].xmap[x]],cb=Cbrow[p->comp[1].xmap[x]],cr=Crrow[p->comp[2].xmap[x]];
+			out[0]=limit[l+p->crr[cr]];
+			out[1]=limit[l+((p->cbg[cb]+p->crg[cr])>>16)];
+			out[2]=limit[l+p->cbb[cb]];
+		}
+	}
+	for(i=0;i<p->ncomp;i++) free(plane[i]);
+}
+
+static void* renderWorker(void* arg){
+	struct renderpool* p=arg;
+	for(;;){
+		pthread_mutex_lock(&p->lock);
+		int r=p->next++;
+		pthread_mutex_unlock(&p->lock);
+		if(r>=p->My) return 0;
+		renderRow(p,r);
+	}
+}
+
+//write the image of scan s as a PPM file to f, using nthreads threads
+//(1/8 scale if s has DC values only)
+//return 0 or -1 if the frame can't be rendered
+static int renderImage(const struct decoder* d,FILE* f,struct scanstate* s,int nthreads){
+	static const double aan[8]={1,1.387039845,1.306562965,1.175875602,1,0.785694958,0.541196100,0.275899379};
+	const struct jpegindex* ix=&d->ix;
+	const uint8_t* data=d->data;
+	int size=d->size,i,k;
+	int32_t qt[4][64];
+	int qdef[4]={0,0,0,0};
+	struct renderpool p;
+	if(ix->sof0<0||!s->coef) return -1;
+	memset(&p,0,sizeof(p));
+	const struct markerseg* m=ix->seg+ix->sof0;
+	p.scale=s->dconly?1:8;
+	p.X=(m->sof.X*p.scale+7)/8;
+	p.Y=(m->sof.Y*p.scale+7)/8;
+	p.ncomp=m->sof.comp;
+	p.mculen=strlen(d->MCUdef);
+	if(p.ncomp!=1&&p.ncomp!=3){
+		logPrintf(d->log,"cannot render %d components\n",p.ncomp);
+		return -1;
+	}
+	for(i=0;i<ix->nseg;i++){		//quantization tables defined before the scan
+		const struct markerseg* t=ix->seg+i;
+		if(t->marker!=0xDB||t->offset>=ix->scanoffset) continue;
+		for(int q=t->table,end=t->table+t->size-2;q<end&&q<size;){
+			int pq=data[q]>>4,tq=data[q]&3;
+			for(k=0,q++;k<64;k++,q+=pq+1) qt[tq][k]=pq?(getbyte(data,size,q)<<8)+getbyte(data,size,q+1):getbyte(data,size,q);
+			qdef[tq]=1;
+		}
+	}
+	int blocks=0,hmax=1,vmax=1;
+	for(i=0;i<p.ncomp;i++){
+		struct rendercomp* c=p.comp+i;
+		int sfact=getbyte(data,size,m->sof.c+i*3+1),tq=getbyte(data,size,m->sof.c+i*3+2)&3;
+		c->h=sfact>>4;
+		c->v=sfact&0xF;
+		c->first=blocks;
+		blocks+=c->h*c->v;
+		if(c->h>hmax) hmax=c->h;
+		if(c->v>vmax) vmax=c->v;
+		if(!qdef[tq]) logPrintf(d->log,"no quantization table %d: 1 used\n",tq);
+		for(k=0;k<64;k++){
+			int q=(qdef[tq]?qt[tq][k]:1)*aan[zigzag[k]>>3]*aan[zigzag[k]&7]*(1<<IDCT_PASS1)+0.5;
+			c->q[k]=q>32767?32767:q;
+		}
+	}
+	if(blocks!=p.mculen||p.X<=0||p.Y<=0){
+		logPrintf(d->log,"cannot render MCU %s\n",d->MCUdef);
+		return -1;
+	}
+	p.mcuw=hmax*p.scale;
+	p.mcuh=vmax*p.scale;
+	p.Mx=(p.X+p.mcuw-1)/p.mcuw;
+	p.My=(p.Y+p.mcuh-1)/p.mcuh;
+	p.coef=s->coef;
+	p.ncoef=s->ncoef<s->mcucount?s->ncoef:s->mcucount;
+	for(i=0;i<p.ncomp;i++){
+		struct rendercomp* c=p.comp+i;
+		c->xmap=malloc(p.X*sizeof(int));
+		for(int x=0;x<p.X;x++) c->xmap[x]=x*c->h/hmax;
+	}
+	p.rgb=malloc((int64_t)p.X*p.Y*3);
+	for(i=0;i<256;i++){		//16 fraction bits
+		p.crr[i]=(91881*(i-128)+32768)>>16;
+		p.cbb[i]=(116130*(i-128)+32768)>>16;
+		p.crg[i]=-46802*(i-128);
+		p.cbg[i]=-22554*(i-128)+32768;
+	}
+	for(i=0;i<1024;i++) p.limit[i]=i<384?0:i>639?255:i-384;
+	pthread_mutex_init(&p.lock,0);
+	if(nthreads<1) nthreads=1;
+	pthread_t* th=malloc(nthreads*sizeof(pthread_t));
+	for(i=0;i<nthreads;i++) pthread_create(th+i,0,renderWorker,&p);
+	for(i=0;i<nthreads;i++) pthread_join(th[i],0);
+	pthread_mutex_destroy(&p.lock);
+	free(th);
+	fprintf(f,"P6\n%d %d\n255\n",p.X,p.Y);
+	fwrite(p.rgb,3,(int64_t)p.X*p.Y,f);
+	logPrintf(d->log,"rendered %dx%d (%d of %d MCU)\n",p.X,p.Y,p.ncoef,p.Mx*p.My);
+	for(i=0;i<p.ncomp;i++) free(p.comp[i].xmap);
+	free(p.rgb);
+	return 0;
+}
+
+//sidecar MCU index (-index), numbers are little endian
+//header:		"JDIX", u16 version, u16 header size, u32 file size, u32 MCU step,
+//				u32 checkpoints, u32 DC predictors n, u64 file hash
+//checkpoints, one every MCU step:
+//	u64 bit address, u32 MCU, u32 MCUs since the last restart marker, u32 Y blocks,
+//	u32 C blocks, u8 next restart marker #, n x i16 DC predictors (Y, first C, second C ...)
+#define INDEX_VERSION 1
+#define INDEX_HEADSIZE 32
+
+//hash of the input file, to tell whether an index belongs to it (FNV-1a on 8 byte words)
+static uint64_t fileHash(const uint8_t* data,int size){
+	uint64_t h=0xcbf29ce484222325ULL,w;
+	int i;
+	for(i=0;i+8<=size;i+=8){
+		memcpy(&w,data+i,8);
+		h=(h^w)*0x100000001b3ULL;
+	}
+	for(;i<size;i++) h=(h^data[i])*0x100000001b3ULL;
+	return h;
+}
+
+//write the checkpoints of s to index file f, for input data of fsize bytes and ndc DC predictors
+static void indexWrite(FILE* f,const struct scanstate* s,const uint8_t* data,int fsize,int ndc){
+	struct textbuf t;
+	textInit(&t,0);
+	textWrite(&t,"JDIX",4);
+	binPut(&t,INDEX_VERSION,2);
+	binPut(&t,INDEX_HEADSIZE,2);
+	binPut(&t,fsize,4);
+	binPut(&t,s->ckstep,4);
+	binPut(&t,s->nck,4);
+	binPut(&t,ndc,4);
+	binPut(&t,fileHash(data,fsize),8);
+	for(int i=0;i<s->nck;i++){
+		const struct checkpoint* c=s->ck+i;
+		binPut(&t,c->pos,8);
+		binPut(&t,c->mcu,4);
+		binPut(&t,c->restartCount,4);
+		binPut(&t,c->Ny,4);
+		binPut(&t,c->Nc,4);
+		binPut(&t,c->next_rstnum,1);
+		for(int k=0;k<ndc;k++) binPut(&t,c->dc[k],2);
+	}
+	fwrite(t.buf,1,t.len,f);
+	textFree(&t);
+}
+
+//read from index file f the last checkpoint at MCU mcu or before, for input data
+//of fsize bytes and ndc DC predictors
+//return 1 if found, 0 if none or the index is not for this file
+static int indexFind(FILE* f,const uint8_t* data,int fsize,int ndc,int mcu,struct checkpoint* c){
+	uint8_t h[INDEX_HEADSIZE],r[25+2*32];
+	int len=25+2*ndc,n,step,i;
+	if(fseek(f,0,SEEK_SET)||fread(h,1,INDEX_HEADSIZE,f)!=INDEX_HEADSIZE) return 0;
+	if(memcmp(h,"JDIX",4)||binGet(h+4,2)!=INDEX_VERSION||binGet(h+8,4)!=fsize||binGet(h+20,4)!=ndc) return 0;
+	if(binGet(h+24,8)!=fileHash(data,fsize)) return 0;
+	step=binGet(h+12,4);
+	n=binGet(h+16,4);
+	if(step<=0||n<=0||mcu<0) return 0;
+	i=mcu/step<n?mcu/step:n-1;	//checkpoint i is at MCU i*step
+	if(fseek(f,binGet(h+6,2)+(long)i*len,SEEK_SET)||fread(r,1,len,f)!=len) return 0;
+	c->pos=binGet(r,8);
+	c->mcu=binGet(r+8,4);
+	c->restartCount=binGet(r+12,4);
+	c->Ny=binGet(r+16,4);
+	c->Nc=binGet(r+20,4);
+	c->next_rstnum=r[24];
+	memset(c->dc,0,sizeof(c->dc));
+	for(int k=0;k<ndc;k++) c->dc[k]=(int16_t)binGet(r+25+2*k,2);
+	return c->mcu<=mcu;
+}
+
+//read from index file f the bit addresses of all its checkpoints (MCU starts), for input
+//data of fsize bytes and ndc DC predictors
+//return the addresses (to be freed), their number in *n; 0 if the index is not for this file
+static int64_t* indexPositions(FILE* f,const uint8_t* data,int fsize,int ndc,int* n){
+	uint8_t h[INDEX_HEADSIZE],r[25+2*32];
+	int len=25+2*ndc;
+	*n=0;
+	if(fseek(f,0,SEEK_SET)||fread(h,1,INDEX_HEADSIZE,f)!=INDEX_HEADSIZE) return 0;
+	if(memcmp(h,"JDIX",4)||binGet(h+4,2)!=INDEX_VERSION||binGet(h+8,4)!=fsize||binGet(h+20,4)!=ndc) return 0;
+	if(binGet(h+24,8)!=fileHash(data,fsize)||fseek(f,binGet(h+6,2),SEEK_SET)) return 0;
+	int64_t* pos=malloc((binGet(h+16,4)+1)*sizeof(int64_t));
+	while(*n<(int)binGet(h+16,4)&&fread(r,1,len,f)==len) pos[(*n)++]=binGet(r,8);
+	return pos;
+}
+
+//byte position after every restart marker between bytes start and end, as long as
+//the marker numbers follow each other (the marker n-1 starts interval n)
+//return the positions (to be freed), their number in *n
+static int* restartMarkers(const uint8_t* data,int start,int end,int* n){
+	int size=256,*rst=malloc(size*sizeof(int));
+	const uint8_t* p=data+start;
+	*n=0;
+	while(p<data+end-1&&(p=memchr(p,0xFF,data+end-1-p))){
+		if(p[1]>=0xD0&&p[1]<=0xD7){
+			if(p[1]-0xD0!=(*n&7)) break;
+			if(*n==size){
+				size*=2;
+				rst=realloc(rst,size*sizeof(int));
+			}
+			rst[(*n)++]=p+2-data;
+		}
+		p++;
+	}
+	return rst;
+}
+
+//decode the MCUs in the rectangle x,y,w,h (in MCU) with text on t, up to bit address limit:
+//the run of every row is preceded by its MCU and bit range, to splice it back into the scan;
+//the MCUs between runs are decoded without output, after jumping to the restart interval or
+//the checkpoint of index idx (ndc DC predictors) nearest to the next run
+static void decodeRegion(struct bitreader* br,struct scanstate* s,struct textbuf* t,int64_t limit,int x,int y,int w,int h,FILE* idx,int ndc){
+	const struct decoder* d=br->d;
+	int R=d->restartInt,nrst=0,ny=0,nc=0;
+	int* rst=R>0?restartMarkers(d->data,bitpos(br)>>3,limit>>3,&nrst):0;
+	for(int i=0;d->MCUdef[i];i++){
+		if(d->MCUdef[i]=='Y') ny++;
+		if(d->MCUdef[i]=='C') nc++;
+	}
+	struct textbuf run;
+	textInit(&run,0);
+	for(int row=y;row<y+h&&bitpos(br)<limit;row++){
+		int first=row*s->Mx+x;
+		struct checkpoint c;
+		c.mcu=-1;
+		if(idx&&!indexFind(idx,d->data,d->size,ndc,first,&c)) c.mcu=-1;
+		if(R>0&&first/R>0&&first/R<=nrst&&first/R*R>c.mcu){		//interval k starts after marker k-1
+			int k=first/R;
+			c.pos=rst[k-1]*8LL;
+			c.mcu=k*R;
+			c.restartCount=0;
+			c.next_rstnum=k&7;
+			c.Ny=s->Ny+(c.mcu-s->mcucount)*ny;
+			c.Nc=s->Nc+(c.mcu-s->mcucount)*nc;
+			memset(c.dc,0,sizeof(c.dc));
+		}
+		if(c.mcu>s->mcucount&&s->iblock==0){
+			bitseek(br,c.pos);
+			s->mcucount=c.mcu;
+			s->restartCount=c.restartCount;
+			s->next_rstnum=c.next_rstnum;
+			s->Ny=c.Ny;
+			s->Nc=c.Nc;
+			memcpy(s->dc,c.dc,sizeof(s->dc));
+		}
+		if(s->mcucount<first){
+			s->mcustop=first;
+			s->skip=1;
+			decodeScan(br,s,t,limit,0);
+			s->skip=0;
+		}
+		int64_t start=bitpos(br),end;
+		s->mcustop=first+w;
+		decodeScan(br,s,&run,limit,0);
+		end=bitpos(br);
+		textPrintf(t,"\n//region MCU %d-%d (@0x%X.%d-0x%X.%d)",first,s->mcucount-1,(int)(start>>3),(int)(start&7),(int)(end>>3),(int)(end&7));
+		textWrite(t,run.buf,run.len);
+		run.len=0;
+	}
+	textFree(&run);
+	free(rst);
+}
+
+//decode jpeg file f to text file (or binary container with FORMAT_BIN, JSON
+//analysis with FORMAT_ANALYZE) f2 (f2=0: list markers only) using decoder d
+//return the number of MCU found or -1 on error
+int decodeJpeg(struct decoder* d,FILE* f,FILE* f2,int nthreads){
+	int size,found=0;
+	int X=0,Y=0,Mx=0,My=0,nmcu=-1,mcuPixX=0,mcuPixY=0;
+	int Ny=0,Nc=0;
+	int fsize=0;
+	int mapped;
+	uint8_t* data=mapfile(f,&fsize,&mapped);
+	strcpy(d->MCUdef,"YYCC");	//forget the previous image
+	d->restartInt=-1;
+	hufftablesInit(&d->ht);
+	d->data=data;
+	d->size=fsize;
+	d->sofmcu=-1;
+	indexJpeg(d);
+	struct jpegindex* ix=&d->ix;
+	int scanoffset=ix->scanoffset;
+	int endoffset=ix->endoffset;
+	if(d->log) fflush(d->log);
+	if(f2||d->format==FORMAT_VERIFY||d->format==FORMAT_DIFF||d->format==FORMAT_SPLICE){
+		if(!data) return -1;
+		struct textbuf out;
+		int bin=d->format==FORMAT_BIN,an=d->format==FORMAT_ANALYZE;
+		int text=d->format==FORMAT_TEXT,render=d->format==FORMAT_RENDER||d->format==FORMAT_THUMB;
+		int region=text&&d->rw>0&&d->rh>0;
+		textInit(&out,text?f2:0);		//binary container is written at the end
+		if(ix->sof0>=0){		//start of frame
+			struct markerseg* m=ix->seg+ix->sof0;
+			d->MCUdef[0]=0;
+			logPrintf(d->log,"Precision=%d",m->sof.P);
+			Y=m->sof.Y;
+			X=m->sof.X;
+			int comp=m->sof.comp,c=m->sof.c;
+			logPrintf(d->log," %dx%d %d components:\n",X,Y,comp);
+			if(text) textPrintf(&out,"// %dx%d %d components:\n",X,Y,comp);
+			for(;comp>0;comp--,c+=3){
+				int id=getbyte(data,fsize,c);
+				int sfact=getbyte(data,fsize,c+1);
+				int dest=getbyte(data,fsize,c+2);
+				char type[2]={0,0};
+				if(dest==0) type[0]='Y';
+				if(dest==1) type[0]='C';
+				logPrintf(d->log,"ID:%d [%02X] Dest:%d\n",id,sfact,dest);
+				if(text) textPrintf(&out,"//ID:%d [%02X] Dest:%d\n",id,sfact,dest);
+				for(int n=(sfact>>4)*(sfact&0xF);n>0;n--) strncat(d->MCUdef,type,sizeof(d->MCUdef)-1-strlen(d->MCUdef));	//sfact EOF past a truncated SOF0
+				if((sfact>>4)>mcuPixX) mcuPixX=(sfact>>4);
+				if((sfact&0xF)>mcuPixY) mcuPixY=(sfact&0xF);
+			}
+			mcuPixX*=8;
+			mcuPixY*=8;
+			if(mcuPixX>0&&mcuPixY>0&&Y>0) nmcu=((X+mcuPixX-1)/mcuPixX)*((Y+mcuPixY-1)/mcuPixY);
+			d->sofmcu=nmcu;
+			logPrintf(d->log,"MCU: %s (%dx%d pixel)\n",d->MCUdef,mcuPixX,mcuPixY);
+			if(text) textPrintf(&out,"//MCU: %s (%dx%d pixel)\n",d->MCUdef,mcuPixX,mcuPixY);
+			Mx=0.5+(float)X/(float)mcuPixX;
+			My=0.5+(float)Y/(float)mcuPixY;
+			logPrintf(d->log,"[%dx%d=%d MCU]\n",Mx,My,Mx*My);
+			if(text) textPrintf(&out,"//[%dx%d=%d MCU]\n",Mx,My,Mx*My);
+		}
+		if(ix->dri>=0){						//define restart interval
+			d->restartInt=ix->seg[ix->dri].interval;
+			logPrintf(d->log,"Restart interval: %d\n",d->restartInt);
+			if(text) textPrintf(&out,"//Restart interval: %d\n",d->restartInt);
+		}
+		for(int h=0;h<ix->nseg;h++){	//define huffman table
+			if(ix->seg[h].marker!=0xC4) continue;
+			int dht=ix->seg[h].table;
+			size=ix->seg[h].size-2;	//2 bytes less to exclude size
+			if(size>fsize-dht) size=fsize-dht;
+			if(size<0) size=0;
+			uint8_t table[size+512];	//margin for corrupted tables
+			memset(table,0,sizeof(table));
+			memcpy(table,data+dht,size);
+			int (*HTX)[3]=0;
+			if(size==sizeof(HT0)&&!memcmp(table,HT0,size)) logPrintf(d->log,"standard Huffman table @0x%X\n",dht);
+			else if(size==sizeof(HT1)&&!memcmp(table,HT1,size)) logPrintf(d->log,"standard Huffman table (Y DC) @0x%X\n",dht);
+			else if(size==sizeof(HT2)&&!memcmp(table,HT2,size)) logPrintf(d->log,"standard Huffman table (Y AC) @0x%X\n",dht);
+			else if(size==sizeof(HT3)&&!memcmp(table,HT3,size)) logPrintf(d->log,"standard Huffman table (C DC) @0x%X\n",dht);
+			else if(size==sizeof(HT4)&&!memcmp(table,HT4,size)) logPrintf(d->log,"standard Huffman table (C AC) @0x%X\n",dht);
+			else{
+				//printf("DHT: %dB\n",size);
+				int huffsize[256];
+				int fullcode[256];
+				for(int z=0;z<size;){
+					//printf("Dest: %d %s\n",table[z]&0xF,(table[z]>>4)?"AC":"DC");
+					if((table[z]&0xF)==0&&(table[z]>>4)==0) HTX=d->ht.YDC;
+					else if((table[z]&0xF)==0&&(table[z]>>4)==1) HTX=d->ht.YAC;
+					else if((table[z]&0xF)==1&&(table[z]>>4)==0) HTX=d->ht.CDC;
+					else if((table[z]&0xF)==1&&(table[z]>>4)==1) HTX=d->ht.CAC;
+					//printf("%p %p %p %p %p\n",HTX,YDC,YAC,CDC,CAC);
+					int k=17,j,ncode=0;
+					for(j=0;j<256;j++) huffsize[j]=0;
+					for(int i=0;i<16;i++){
+						for(j=0;j<table[z+1+i];j++){
+							huffsize[k-17+j]=i+1;
+							fullcode[k-17+j]=table[z+k+j];
+							ncode++;
+						}
+						k+=j;
+					}
+					z+=k;
+					//if(z>29) continue;
+					//ISO/IEC 10918-1 : 1993(E) Figure C.2 – Generation of table of Huffman codes
+					k=0;
+					int code=0;
+					int si=huffsize[0];
+					int huffcode[256];
+					do{
+						do{
+							huffcode[k]=code;
+							code++;
+							k++;
+						} while (huffsize[k]==si);
+						if(huffsize[k]==0) break;
+						do{
+							code<<=1;
+							si++;
+						} while (huffsize[k]!=si);
+					} while (huffsize[k]);
+					//end C.2
+					//printf("[#bit,prefix,code]\n");
+					for(int i=0;i<ncode;i++){
+						//printf("%d,%X,%X\n",huffsize[i],huffcode[i],fullcode[i]);
+						HTX[i][0]=huffsize[i];
+						HTX[i][1]=huffcode[i];
+						HTX[i][2]=fullcode[i];
+					}
+					HTX[ncode][0]=-1;
+					HTX[ncode][1]=-1;
+					HTX[ncode][2]=-1;
+				}
+				if(bin){
+					if(HTX){
+						int n;
+						for(n=0;HTX[n][0]!=-1;n++);
+						binPut(&out,BIN_DHT,1);
+						binPut(&out,HTX==d->ht.YDC?0:HTX==d->ht.YAC?1:HTX==d->ht.CDC?2:3,1);
+						binPut(&out,n,2);
+						for(int i=0;i<n*3;i++) binPut(&out,HTX[i/3][i%3],4);
+					}
+					continue;
+				}
+				if(!text) continue;
+				textPrintf(&out,"<dht>\n");
+				if(HTX==d->ht.YDC) textPrintf(&out,"YDC ");
+				else if(HTX==d->ht.YAC) textPrintf(&out,"YAC ");
+				else if(HTX==d->ht.CDC) textPrintf(&out,"CDC ");
+				else if(HTX==d->ht.CAC) textPrintf(&out,"CAC ");
+				if(HTX) for(int i=0;HTX[i][0]!=-1;i++) textPrintf(&out,"[%X %X %X]",HTX[i][0],HTX[i][1],HTX[i][2]);
+				textPrintf(&out,"\n</dht>\n");
+			}
+		}
+		if(scanoffset&&bin){
+			binPut(&out,BIN_RAW,1);
+			binPut(&out,scanoffset,4);
+			textWrite(&out,(const char*)data,scanoffset);
+		}
+		else if(scanoffset&&text){	//copy first data as raw
+			textPuts(&out,"<raw>");
+			for(int p=0;p<scanoffset;p+=32){
+				textPuts(&out,"\n0x");
+				textPutHex(&out,data+p,scanoffset-p<32?scanoffset-p:32);
+			}
+			textPuts(&out,"\n</raw>");
+			if(d->log) fflush(d->log);
+		}
+		buildHuffLUTs(d);
+		struct bitreader br;
+		readerInit(&br,d);
+		bitseek(&br,scanoffset*8);
+		struct scanstate st;
+		memset(&st,0,sizeof(st));
+		st.Mx=Mx>0?Mx:1;		//no SOF0 or bad size: one MCU per row
+		if(d->format==FORMAT_VERIFY||d->format==FORMAT_DIFF||d->format==FORMAT_SPLICE){
+			if(d->format==FORMAT_VERIFY&&scanoffset&&ix->sof0>=0) d->verify=verifyScan(&br,nmcu,&d->verifypos);
+			if(d->format==FORMAT_SPLICE){
+				d->scanstart=scanoffset;
+				d->scansize=fsize;
+				d->scan=realloc(d->scan,fsize+1);
+				memcpy(d->scan,data,fsize);
+				found=scanoffset&&ix->sof0>=0?fsize:-1;
+			}
+			if(d->format==FORMAT_DIFF){
+				mcuStarts(&br,d,scanoffset*8LL);
+				d->scanstart=scanoffset;
+				d->scansize=endoffset>scanoffset?endoffset-scanoffset:0;
+				d->scan=realloc(d->scan,d->scansize+1);
+				memcpy(d->scan,data+scanoffset,d->scansize);
+				d->Mx=st.Mx;
+				found=d->nmcu;
+			}
+			textFree(&out);
+			unmapfile(data,fsize,mapped);
+			d->data=0;
+			d->size=0;
+			return found;
+		}
+		int ndc=1;		//DC predictors
+		for(int i=0;d->MCUdef[i];i++) ndc+=d->MCUdef[i]=='C';
+		if(an){
+			st.flagsize=Mx*My>0?Mx*My+1:256;
+			st.flags=calloc(st.flagsize,1);
+		}
+		if(render&&nmcu>0){
+			st.ncoef=nmcu;
+			st.dconly=d->format==FORMAT_THUMB;
+			st.coef=calloc((size_t)nmcu*strlen(d->MCUdef)*(st.dconly?1:64),sizeof(int16_t));
+		}
+		if(d->index&&d->indexstep>0&&d->mculast<0&&!region) st.ckstep=d->indexstep;
+		if(!d->MCUdef[0]) logPrintf(d->log,"no Y or C block in the MCU: scan not decoded\n");	//no progress
+		else if(d->mculast>=0){		//MCU range, from the nearest checkpoint
+			struct checkpoint c;
+			if(d->indexin&&indexFind(d->indexin,data,fsize,ndc,d->mcufirst,&c)){
+				bitseek(&br,c.pos);
+				st.mcucount=c.mcu;
+				st.restartCount=c.restartCount;
+				st.next_rstnum=c.next_rstnum;
+				st.Ny=c.Ny;
+				st.Nc=c.Nc;
+				memcpy(st.dc,c.dc,sizeof(st.dc));
+			}
+			if(st.mcucount<d->mcufirst){	//MCUs before the range are decoded without output
+				st.mcustop=d->mcufirst;
+				st.skip=1;
+				decodeScan(&br,&st,&out,endoffset*8LL-16,0);
+				st.skip=0;
+			}
+			st.mcustop=d->mculast+1;
+			decodeScan(&br,&st,&out,endoffset*8LL-16,0);
+		}
+		else if(region){			//MCU rectangle, clipped to the image
+			int x=d->rx,y=d->ry,x1=d->rx+d->rw,y1=d->ry+d->rh;
+			if(d->regionpx&&mcuPixX>0&&mcuPixY>0){
+				x/=mcuPixX;
+				y/=mcuPixY;
+				x1=(x1+mcuPixX-1)/mcuPixX;
+				y1=(y1+mcuPixY-1)/mcuPixY;
+			}
+			if(x1>st.Mx) x1=st.Mx;
+			if(y1>My&&My>0) y1=My;
+			if(x<x1&&y<y1&&(!d->regionpx||(mcuPixX>0&&mcuPixY>0))) decodeRegion(&br,&st,&out,endoffset*8LL-16,x,y,x1-x,y1-y,d->indexin,ndc);
 			else{
-				sscanf(inbuf+i,"%d",&dccoeff);
+				logPrintf(d->log,"region %d,%d,%d,%d%s outside the image (%dx%d MCU)\n",d->rx,d->ry,d->rw,d->rh,d->regionpx?"px":"",st.Mx,My);
+				region=-1;
+			}
+		}
+		else if(st.coef){			//up to EOI, the last MCU can start in its last 2 bytes
+			st.mcustop=nmcu;
+			decodeScan(&br,&st,&out,endoffset*8LL,0);
+		}
+		else if(an||st.ckstep) decodeScan(&br,&st,&out,endoffset*8LL-16,0);	//serial: DC predictors depend on all the MCUs before
+		else if(nthreads>1&&d->restartInt>0) decodeScanParallel(&br,&st,&out,scanoffset,endoffset*8LL-16,nthreads);	//decode MCU (-2 bytes to end at last MCU)
+		else if(nthreads>1) decodeScanSpeculative(&br,&st,&out,scanoffset,endoffset*8LL-16,nthreads);
+		else decodeScan(&br,&st,&out,endoffset*8LL-16,0);
+		int mcucount=st.mcucount,*rstErrStat=st.rstErrStat,rstErrStat_extra=st.rstErrStat_extra;
+		found=region<0?-1:mcucount;
+		Ny=st.Ny;
+		Nc=st.Nc;
+		if(text) textPuts(&out,d->mculast<0&&!region?"\n<EOI></EOI>\n":"\n");
+		logPrintf(d->log,"found %d MCU (%d Y + %d C)\n",mcucount,Ny,Nc);
+		if(text) textPrintf(&out,"//found %d MCU (%d Y + %d C)\n",mcucount,Ny,Nc);
+		if(d->restartInt>0){
+			int e=0;
+			//convert to absolute chains
+			for(int i=49;i>0;i--){
+				for(int j=i-1;rstErrStat[i]&&j>0;j--){
+					rstErrStat[j]-=rstErrStat[i];
+				}
+				if(rstErrStat[i]) e=1;
+			}
+			if(e){
+				logPrintf(d->log,"Missing restart markers\nL \t#\n");
+				for(int i=1;i<50;i++){
+					if(rstErrStat[i]) logPrintf(d->log,"%d\t%d\n",i,rstErrStat[i]);
+				}
+				if(rstErrStat_extra) logPrintf(d->log,">49\t>0\n");
+			}
+		}
+		if(bin) binWrite(f2,(const uint8_t*)out.buf,out.len);
+		if(an){
+			analyzeReport(d,f2,&st,X,Y,My);
+			free(st.flags);
+		}
+		if(render){
+			if(renderImage(d,f2,&st,nthreads)<0) found=-1;
+			free(st.coef);
+		}
+		if(st.ckstep>0) indexWrite(d->index,&st,data,fsize,ndc);
+		free(st.ck);
+		textFree(&out);
+	}
+	unmapfile(data,fsize,mapped);
+	d->data=0;
+	d->size=0;
+	return found;
+}
+
+//check jpeg file f using decoder d, see jpeg-decomp.h
+int verifyJpeg(struct decoder* d,FILE* f,long long* errpos){
+	int format=d->format;
+	d->format=FORMAT_VERIFY;
+	d->verify=VERIFY_READ;
+	d->verifypos=0;
+	decodeJpeg(d,f,0,1);
+	d->format=format;
+	if(errpos) *errpos=d->verifypos;
+	return d->verify;
+}
+
+//number of equal bytes at the start of a and b (n at most), comparing 8 bytes at a time
+static inline int equalBytes(const uint8_t* a,const uint8_t* b,int n){
+	int i=0;
+	for(;i+8<=n;i+=8){
+		uint64_t x,y;
+		memcpy(&x,a+i,8);
+		memcpy(&y,b+i,8);
+		if(x!=y) break;
+	}
+	while(i<n&&a[i]==b[i]) i++;
+	return i;
+}
+
+//index of the last MCU of d starting at bit address pos or before
+static int mcuAt(const struct decoder* d,int64_t pos){
+	int a=0,b=d->nmcu;
+	while(b-a>1){
+		int m=(a+b)/2;
+		if(d->mcupos[m]<=pos) a=m;
+		else b=m;
+	}
+	return a;
+}
+
+//index of the MCU of d starting at bit address pos, from index i on (-1: none)
+static int mcuFind(const struct decoder* d,int i,int64_t pos){
+	i=mcuAt(d,pos)>i?mcuAt(d,pos):i;
+	return i<d->nmcu&&d->mcupos[i]==pos?i:-1;
+}
+
+#define DIFF_MATCH 32	//equal bytes needed after an MCU start to take the streams as realigned
+//write a range of differing MCUs: a..a2-1 of d, b..b2-1 of e
+static void diffRange(FILE* out,const struct decoder* d,int a,int a2,const struct decoder* e,int b,int b2){
+	int64_t pa=d->mcupos[a]+d->scanstart*8LL,pb=e->mcupos[b]+e->scanstart*8LL;
+	fprintf(out,"MCU %d (%d,%d) - %d (%d,%d) @0x%X.%d",a,a%d->Mx,a/d->Mx,a2-1,(a2-1)%d->Mx,(a2-1)/d->Mx,(int)(pa>>3),(int)(pa&7));
+	if(b2>b) fprintf(out,", other: MCU %d (%d,%d) - %d (%d,%d) @0x%X.%d\n",b,b%e->Mx,b/e->Mx,b2-1,(b2-1)%e->Mx,(b2-1)/e->Mx,(int)(pb>>3),(int)(pb&7));
+	else fprintf(out,", other: missing\n");
+}
+
+//compare the scan data of jpeg files f and other MCU by MCU using decoder d, see jpeg-decomp.h
+//equal bytes are skipped 8 at a time; at the first different byte both scans are walked
+//from the MCU that holds it until an MCU start of f has an MCU start of other at the same
+//distance as before the difference (bytes changed) or from the end (bytes added or removed),
+//followed by DIFF_MATCH equal bytes
+int diffJpeg(struct decoder* d,FILE* f,FILE* other,FILE* out){
+	struct decoder* e=decoderNew();
+	int format=d->format,n=0;
+	decoderLog(e,0);
+	e->format=d->format=FORMAT_DIFF;
+	free(d->mcupos);
+	d->mcupos=0;
+	d->nmcu=0;
+	int ok=decodeJpeg(d,f,0,1)>0&&decodeJpeg(e,other,0,1)>0;
+	d->format=format;
+	if(!ok){
+		decoderFree(e);
+		return -1;
+	}
+	const uint8_t *a=d->scan,*b=e->scan;
+	int64_t delta=0,dend=(e->scansize-d->scansize)*8LL;	//bit address of other - bit address of f
+	int i=0,j=0;
+	fprintf(out,"scan data: %d bytes @0x%X, %d MCU; other: %d bytes @0x%X, %d MCU\n",d->scansize,d->scanstart,d->nmcu,e->scansize,e->scanstart,e->nmcu);
+	while(i<d->nmcu&&j<e->nmcu){
+		int pa=d->mcupos[i]>>3,pb=e->mcupos[j]>>3;
+		int len=d->scansize-pa<e->scansize-pb?d->scansize-pa:e->scansize-pb;
+		int k=equalBytes(a+pa,b+pb,len);
+		if(k==len&&d->scansize-pa==e->scansize-pb) break;	//equal up to the end
+		int i2=mcuAt(d,(pa+k)*8LL);
+		int j2=mcuFind(e,j,d->mcupos[i2]+delta);
+		if(j2<0) j2=mcuAt(e,(pb+k)*8LL);
+		int i3,j3=-1;
+		for(i3=i2+1;i3<d->nmcu&&j3<0;i3++){	//realign
+			for(int c=0;c<2&&j3<0;c++){
+				int64_t dc=c?dend:delta;
+				int q=mcuFind(e,j2+1,d->mcupos[i3]+dc);
+				if(q<0) continue;
+				int qa=d->mcupos[i3]>>3,qb=e->mcupos[q]>>3;
+				int m=d->scansize-qa<e->scansize-qb?d->scansize-qa:e->scansize-qb;
+				if(m>DIFF_MATCH) m=DIFF_MATCH;
+				if(d->mcupos[i3]+dc!=e->mcupos[q]||equalBytes(a+qa,b+qb,m)<m) continue;
+				j3=q;
+				delta=dc;
+			}
+		}
+		if(j3<0){		//not realigned: different up to the end
+			diffRange(out,d,i2,d->nmcu,e,j2,e->nmcu);
+			n++;
+			break;
+		}
+		i3--;
+		diffRange(out,d,i2,i3,e,j2,j3);
+		n++;
+		i=i3;
+		j=j3;
+	}
+	if(i>=d->nmcu&&j<e->nmcu){	//MCUs only in other
+		fprintf(out,"other: MCU %d - %d not in the file\n",j,e->nmcu-1);
+		n++;
+	}
+	else if(j>=e->nmcu&&i<d->nmcu){
+		diffRange(out,d,i,d->nmcu,e,j,j);
+		n++;
+	}
+	fprintf(out,"%d differing ranges\n",n);
+	decoderFree(e);
+	return n;
+}
+
+//splice of the edited blocks of a text into a copy of its base file (encoderBase):
+//base bits are written as they are while the output keeps their alignment, otherwise
+//shifted up to the next marker, that aligns the output again
+struct splice{
+	const struct decoder* d;	//base file (d->scan) and its tables
+	struct bitreader br;	//base blocks
+	struct bitreader src;	//base bits to copy
+	struct bitwriter* bw;	//output
+	int64_t copied;			//base bits [0,copied) are written
+	int iblock;				//block # in MCU at copied (-1: unknown)
+	int marker;				//byte position of the next marker (-1: none, 0: not searched yet)
+	int64_t* ck;			//bit address of the MCUs of the base index (MCU starts)
+	int nck;
+};
+
+//return the first occurrence of string str in text p of n characters, 0 if none
+static const char* findText(const char* p,int n,const char* str){
+	int m=strlen(str);
+	for(const char* q=p;q&&q+m<=p+n;q=memchr(q+1,str[0],p+n-q-1)) if(*q==str[0]&&!memcmp(q,str,m)) return q;
+	return 0;
+}
+
+//compare the bits written in memory by w with the base bits at the position of br,
+//moving br after them
+//return 1 if equal
+static int sameBits(struct bitreader* br,const struct bitwriter* w){
+	for(size_t i=0;i<w->len;i++){
+		if(br->nbits<8) fillbits(br);
+		if(br->nbits<8||peekbits(br,8)!=w->buf[i]) return 0;
+		skipbits(br,8);
+		if(w->buf[i]==0xFF) i++;	//stuffing
+	}
+	if(w->nbits){
+		if(br->nbits<w->nbits) fillbits(br);
+		if(br->nbits<w->nbits||peekbits(br,w->nbits)!=(int)(w->acc>>(64-w->nbits))) return 0;
+		skipbits(br,w->nbits);
+	}
+	return 1;
+}
+
+//write base bits from sp->copied to b, with no marker between them
+static void spliceBits(struct splice* sp,int64_t b){
+	struct bitreader* br=&sp->src;
+	int n;
+	if(bitpos(br)!=sp->copied) bitseek(br,sp->copied);
+	while((n=b-bitpos(br))>0){
+		if(br->nbits<n&&br->nbits<16) fillbits(br);
+		if(br->nbits==0) break;		//marker or EOF
+		if(n>16) n=16;
+		if(n>br->nbits) n=br->nbits;
+		if(br->stuff&&n>__builtin_clzll(br->stuff)+1) n=__builtin_clzll(br->stuff)+1;	//up to 0xFF, its stuffing counts 8 bits
+		putbits(sp->bw,peekbits(br,n),n);
+		skipbits(br,n);
+	}
+	sp->copied=b;
+}
+
+//write base bits from sp->copied to b when the output has the same alignment:
+//whole bytes (stuffing and markers included) are copied as they are
+static void spliceRaw(struct splice* sp,int64_t b){
+	struct bitwriter* bw=sp->bw;
+	const uint8_t* data=sp->d->scan;
+	int64_t a=sp->copied;
+	int A=a>>3,B=b>>3;
+	if(A==B){		//within a byte
+		putbits(bw,data[A]>>(8-(b&7)),(b&7)-(a&7));
+		sp->copied=b;
+		return;
+	}
+	if(a&7){		//rest of the first byte, skipping its stuffing
+		putbits(bw,data[A],8-(a&7));
+		A+=1+(data[A]==0xFF&&A+1<B&&data[A+1]==0);
+	}
+	emitbytes(bw);
+	if(bw->f){
+		flushbits(bw);
+		fwrite(data+A,1,B-A,bw->f);
+	}
+	else for(int i=A;i<B;i++) putbyte(bw,data[i]);
+	if(b&7) putbits(bw,data[B]>>(8-(b&7)),b&7);
+	sp->copied=b;
+}
+
+//byte position of the first marker (as recognized by the bit reader) from byte p, -1 if none
+static int nextMarker(const struct decoder* d,int p){
+	const uint8_t* data=d->scan;
+	const uint8_t* q=data+p;
+	for(;q<data+d->scansize-1&&(q=memchr(q,0xFF,data+d->scansize-1-q));q++)
+		if(q[1]==0xD9||(d->restartInt>=0&&q[1]>=0xD0&&q[1]<=0xD7)) return q-data;
+	return -1;
+}
+
+//write the base from sp->copied to bit address x (a block start or the end of the file)
+static void spliceCopy(struct splice* sp,int64_t x){
+	const struct decoder* d=sp->d;
+	struct bitreader* br=&sp->br;
+	int mculen=strlen(d->MCUdef);
+	while(sp->copied<x){
+		if((sp->bw->nbits&7)==(sp->copied&7)){
+			spliceRaw(sp,x);
+			return;
+		}
+		if(sp->marker==0||(sp->marker>0&&sp->marker*8LL<sp->copied)) sp->marker=nextMarker(d,sp->copied>>3);
+		if(sp->marker<0||sp->marker*8LL>=x){		//shifted up to x
+			spliceBits(sp,x);
+			return;
+		}
+		//a marker before x: the blocks before it are decoded from the last known MCU start,
+		//to drop the padding
+		int a=0,b=sp->nck;
+		while(b-a>1){
+			int m=(a+b)/2;
+			if(sp->ck[m]<sp->marker*8LL) a=m;
+			else b=m;
+		}
+		if(sp->nck&&sp->ck[a]>sp->copied&&sp->ck[a]<sp->marker*8LL){
+			spliceBits(sp,sp->ck[a]);
+			sp->iblock=0;
+		}
+		if(sp->iblock<0){
+			spliceBits(sp,sp->marker*8LL);	//no block start known: padding kept
+			putbit(sp->bw,-1);
+			continue;
+		}
+		for(;;){
+			if(bitpos(br)!=sp->copied) bitseek(br,sp->copied);
+			int64_t s=sp->copied;
+			int r=decodeBlock(br,0,0,d->MCUdef[sp->iblock]=='C'?C_BLOCK:Y_BLOCK)&0xF;
+			if(r==DECODE_OK||r==DECODE_ERR){
+				spliceBits(sp,bitpos(br));
+				sp->iblock=(sp->iblock+1)%mculen;
+				continue;
+			}
+			if(r==DECODE_UNKNOWN){		//end of data
+				spliceBits(sp,x);
+				putbit(sp->bw,-1);
+				return;
+			}
+			//marker: the bits before it but the padding (less than 8 bits set to 1 after
+			//the last block), then padding as by the encoder
+			int64_t m=bitpos(br)-16;
+			int pad=m-s<8&&((d->scan[(m>>3)-1]|0xFF<<(m-s))&0xFF)==0xFF;
+			spliceBits(sp,pad?s:m);
+			putbit(sp->bw,-1);
+			sp->copied=m;
+			sp->iblock=0;
+			break;
+		}
+	}
+}
+
+//encode text (len characters) with e by splicing the blocks that differ from the base
+//file into a copy of it written on f2, using decoder d on the base (FORMAT_SPLICE)
+//and the MCU starts of its index idx (0: none):
+//a block is unchanged if it encodes to the base bits at its address [Y@0x...], or
+//the base decodes to the same text there (damaged blocks);
+//DC values are differences as coded, so the copied blocks need no change
+//return the number of blocks encoded, -1 if the text does not belong to the base (*err)
+static int spliceText(struct encstate* e,struct decoder* d,FILE* idx,const char* text,int len,FILE* f2,const char** err){
+	struct splice sp;
+	struct encstate blk;	//a block at a time, in memory
+	struct bitwriter hdr;
+	struct textbuf tb;
+	int mculen=strlen(d->MCUdef),type,start,end,pos=0,prev=0,ib=0,nblock=0,head=0,ndc=1;
+	for(int i=0;i<mculen;i++) ndc+=d->MCUdef[i]=='C';
+	d->data=d->scan;
+	d->size=d->scansize;
+	memset(&sp,0,sizeof(sp));
+	sp.d=d;
+	sp.iblock=-1;
+	readerInit(&sp.br,d);
+	readerInit(&sp.src,d);
+	sp.bw=&e->bw;
+	if(idx) sp.ck=indexPositions(idx,d->scan,d->scansize,ndc,&sp.nck);
+	memset(&blk,0,sizeof(blk));
+	blk.enc=e->enc;
+	blk.quiet=1;
+	writerInit(&blk.bw,0);
+	writerInit(&hdr,0);
+	textInit(&tb,0);
+	writerInit(&e->bw,f2);
+	*err=0;
+	while(!*err&&(type=nextTag(text,len,&pos,&start,&end))!=TAG_END){
+		if(type==TAG_RAW&&!head) parseRaw(&hdr,text+start,end-start);
+		else if(type==TAG_RAW) *err="raw data after the scan start";
+		else if(type==TAG_DHT){
+			parseDHT(&e->enc->ht,text+start,end-start);
+			encoderTables(e->enc);
+		}
+		else if(type==TAG_Y||type==TAG_C){
+			int x,k;
+			if(!head&&(hdr.len!=d->scanstart||memcmp(hdr.buf,d->scan,hdr.len))){
+				*err="header different from the base file";
+				break;
+			}
+			head=1;
+			if(findText(text+prev,start-prev,"************ MCU")) ib=0;		//MCU header before the block
+			prev=end;
+			const char* q=memchr(text+start,'@',end-start);
+			if(!q||!(k=textHex(q+1,text+end-q-1,&x))||q[1+k]!='.'||!isdigit((uint8_t)q[2+k])){
+				*err="block without address";
+				break;
+			}
+			int64_t addr=x*8LL+q[2+k]-'0';
+			if(addr<sp.copied||addr>=d->scansize*8LL){
+				*err="block address out of order";
+				break;
+			}
+			if(d->MCUdef[ib]!=(type==TAG_Y?'Y':'C')){
+				*err="block type different from the base MCU";
 				break;
 			}
+			blk.bw.len=blk.bw.nbits=0;
+			blk.bw.acc=0;
+			encodeBlock(&blk,type,text+start,end-start);
+			bitseek(&sp.br,addr);
+			if(!sameBits(&sp.br,&blk.bw)){
+				bitseek(&sp.br,addr);
+				tb.len=0;
+				int r=decodeBlock(&sp.br,&tb,2,type==TAG_Y?Y_BLOCK:C_BLOCK)&0xF;
+				const char* t=findText(tb.buf,tb.len,type==TAG_Y?"</y>":"</c>");
+				if(!t||tb.len<4||t-tb.buf-4!=end-start||memcmp(tb.buf+4,text+start,end-start)){	//changed
+					if(r!=DECODE_OK&&r!=DECODE_ERR){
+						*err="changed block not on a whole base block";
+						break;
+					}
+					int64_t blockend=bitpos(&sp.br);
+					spliceCopy(&sp,addr);
+					encodeBlock(e,type,text+start,end-start);
+					sp.copied=blockend;
+					sp.iblock=(ib+1)%mculen;
+					nblock++;
+				}
+			}
+			ib=(ib+1)%mculen;
+		}
+	}
+	if(!*err&&!head&&hdr.len&&(hdr.len!=d->scanstart||memcmp(hdr.buf,d->scan,hdr.len))) *err="header different from the base file";
+	if(!*err){
+		spliceCopy(&sp,d->scansize*8LL);
+		flushbits(&e->bw);
+	}
+	writerFree(&e->bw);
+	writerFree(&blk.bw);
+	writerFree(&hdr);
+	textFree(&tb);
+	free(sp.ck);
+	return *err?-1:nblock;
+}
+
+//encode text file (or binary container with FORMAT_BIN) f to jpeg file f2 using encoder e
+//return 0 or -1 on error
+int encodeJpeg(struct encoder* e,FILE* f,FILE* f2,int nthreads){
+	struct encstate st;
+	hufftablesInit(&e->ht);		//<dht> of a previous text
+	encoderTables(e);
+	memset(&st,0,sizeof(st));
+	st.enc=e;
+	int tsize=0;
+	int mapped;
+	char* text=(char*)mapfile(f,&tsize,&mapped);
+	int r=0;
+	struct optstate* o=0;
+	if(e->base){		//only the edited blocks
+		const char* err="text input without -optimize only";
+		struct decoder* d=decoderNew();
+		decoderLog(d,0);
+		decoderFormat(d,FORMAT_SPLICE);
+		if(e->format==FORMAT_TEXT&&!e->optimize){
+			if(decodeJpeg(d,e->base,0,1)<0) err="cannot read the base file";
+			else r=spliceText(&st,d,e->baseidx,text,tsize,f2,&err);
 		}
-		else if(s==1){
-			if(c=='/') s=2;
-			else s=0;
+		decoderFree(d);
+		unmapfile((uint8_t*)text,tsize,mapped);
+		if(err) logPrintf(e->log,"cannot splice: %s\n",err);
+		else logPrintf(e->log,"%d blocks spliced into the base file\n",r);
+		return err?-1:0;
+	}
+	if(e->optimize&&e->format==FORMAT_TEXT){		//first pass: symbol statistics
+		o=calloc(1,sizeof(struct optstate));
+		if(optimizeText(&st,text,tsize,o,0)==0){
+			optimizeTables(o);
+			logPrintf(e->log,"optimized Huffman tables\n");
 		}
-		else if(s==2){
-			if(c=='\n') s=0;
+		else{
+			logPrintf(e->log,"Huffman tables not optimized: %s\n",o->err);
+			free(o);
+			o=0;
+			hufftablesInit(&e->ht);
+			encoderTables(e);
 		}
-		else s=0;
 	}
-	//printf("parseDC: len%d i%d dc%d\n",len,i,dccoeff);
-	int e=encodeH(Htable,dccoeff);
-	int n=e>>24;	//tot bit
-	for(int i=1<<(n-1);i;i>>=1) putbit(e&i?1:0,f);	//MSB first
-	return inbuf+i;
-	if(i<len+1) return 0;
-}
-
-void main (int argc, char **argv) {
-	char filein[2000]="",fileout[2000]="",inschar[10000]="";
-	int offset=0,bitoffset=0,remoffset=0,scanoffset=0,endoffset=0,sof0=0,drioffset=0;
-	int rembit=0,insnum=0,insnumeff=0,ffrem=0,insmcu=0;
-	int dc,nz,ncoeff;
-	int deltaYDC=0,deltaCDC=0,decodeY=0,decodeC=0,decodeMCU=0,removeMCU=0;
-	int prova=0,decode=0,encode=0;
-	char c;
+	else if(e->optimize) logPrintf(e->log,"Huffman tables not optimized: binary input\n");
+	if(o||e->format==FORMAT_BIN||nthreads<2||!encodeTextParallel(&st,text,tsize,f2,nthreads)){
+		struct bitwriter* bw=&st.bw;
+		writerInit(bw,f2);
+		if(o) optimizeText(&st,text,tsize,o,1);
+		else if(e->format==FORMAT_BIN) r=encodeBin(&st,(uint8_t*)text,tsize);
+		else encodeText(&st,text,tsize,0);
+		if(r==0){
+			putbit(bw,-1);	//fill byte with 1 and write to file
+			putbyte(bw,0xFF);
+			putbyte(bw,0xD9);
+			flushbits(bw);
+		}
+		writerFree(bw);
+	}
+	free(o);
+	unmapfile((uint8_t*)text,tsize,mapped);
+	if(r) logPrintf(e->log,"not a valid binary file");
+	else logPrintf(e->log,"%d raw segments\n%d y segments\n%d c segments",st.Nraw,st.Ny,st.Nc);
+	return r;
+}
+
+#ifndef JPEG_DECOMP_LIB
+const char* verifymsg[]={"ok","cannot read","Huffman code error","too many AC coefficients","restart marker error","MCU count mismatch"};
+
+//files of a batch, taken one at a time from a list file or a directory
+struct batch{
+	FILE* list;
+	DIR* dir;
+	const char* dirname;
+	const char* outdir;		//"": next to the input
+	int encode;
+	int format;
+	int optimize;
+	int verify;				//check the files instead of decoding them
+	int nfiles,nok;
+	int nincomplete;		//decoded with fewer or more MCUs than SOF0
+	long long nmcu,nsofmcu;	//MCUs decoded and expected by SOF0
+	pthread_mutex_t lock;
+};
+
+//next input file name, 0 at the end
+int batchNext(struct batch* b,char* name,int size){
+	int r=0;
+	pthread_mutex_lock(&b->lock);
+	if(b->list){
+		while(!r&&fgets(name,size,b->list)){
+			name[strcspn(name,"\r\n")]=0;
+			r=name[0]&&name[0]!='#';		//skip empty lines and comments
+		}
+	}
+	else{
+		struct dirent* de;
+		while(!r&&(de=readdir(b->dir))){
+			const char* ext=strrchr(de->d_name,'.');
+			struct stat st;
+			if(!ext) continue;
+			if(b->encode) r=!strcasecmp(ext,b->format==FORMAT_BIN?".bin":".txt");
+			else r=!strcasecmp(ext,".jpg")||!strcasecmp(ext,".jpeg");
+			snprintf(name,size,"%s/%s",b->dirname,de->d_name);
+			if(r&&(stat(name,&st)||!S_ISREG(st.st_mode))) r=0;
+		}
+	}
+	if(r) b->nfiles++;
+	pthread_mutex_unlock(&b->lock);
+	return r;
+}
+
+//decode or encode batch files with a context per thread;
+//only one file per thread is open at a time
+void* batchWorker(void* arg){
+	struct batch* b=arg;
+	struct decoder* d=0;
+	struct encoder* e=0;
+	char filein[2000],fileout[2100];
+	if(b->encode){
+		e=encoderNew();
+		if(!e) return 0;
+		encoderLog(e,0);
+		encoderFormat(e,b->format);
+		encoderOptimize(e,b->optimize);
+	}
+	else{
+		d=decoderNew();
+		if(!d) return 0;
+		decoderLog(d,0);
+		decoderFormat(d,b->format);
+	}
+	const char* ext=b->encode?".jpg":b->format==FORMAT_BIN?".bin":b->format==FORMAT_ANALYZE?".json":b->format==FORMAT_RENDER||b->format==FORMAT_THUMB?".ppm":".txt";
+	while(batchNext(b,filein,sizeof(filein))){
+		const char* base=strrchr(filein,'/');
+		const char* status="ok";
+		int r=0;
+		base=base?base+1:filein;
+		if(b->verify){
+			long long pos;
+			FILE* f=fopen(filein,"rb");
+			r=f?verifyJpeg(d,f,&pos):VERIFY_READ;
+			if(f) fclose(f);
+			pthread_mutex_lock(&b->lock);
+			if(r==VERIFY_OK) b->nok++;
+			if(r==VERIFY_OK) printf("%s: ok\n",filein);
+			else if(r==VERIFY_READ) printf("%s: %s\n",filein,verifymsg[r]);
+			else printf("%s: %s @0x%llX.%d\n",filein,verifymsg[r],pos>>3,(int)(pos&7));
+			pthread_mutex_unlock(&b->lock);
+			continue;
+		}
+		if(b->outdir[0]) snprintf(fileout,sizeof(fileout),"%s/%s%s",b->outdir,base,ext);
+		else snprintf(fileout,sizeof(fileout),"%s%s",filein,ext);
+		FILE* f=fopen(filein,"rb");
+		FILE* f2=f?fopen(fileout,"wb"):0;
+		if(!f) status="cannot open input";
+		else if(!f2) status="cannot open output";
+		else if(b->encode) r=encodeJpeg(e,f,f2,1);
+		else r=decodeJpeg(d,f,f2,1);
+		if(f2&&fclose(f2)&&r>=0) status="write error";
+		if(f) fclose(f);
+		if(r<0) status=b->encode?"cannot read input":"cannot read image";
+		else if(d&&status[0]=='o'){
+			const struct jpegindex* ix=&d->ix;
+			if(!ix->nseg||ix->seg[0].offset||ix->seg[0].marker!=0xD8||ix->sof0<0||!ix->scanoffset) status="not a JPEG image (no SOI, SOF0 or SOS)";
+			else if(r==0) status="no MCU decoded";
+		}
+		if(f2&&status[0]!='o') remove(fileout);		//no partial output of a failed file
+		pthread_mutex_lock(&b->lock);
+		if(status[0]=='o') b->nok++;
+		if(status[0]!='o') printf("%s: %s\n",filein,status);
+		else if(b->encode) printf("%s -> %s\n",filein,fileout);
+		else{
+			printf("%s -> %s (%d of %d MCU)\n",filein,fileout,r,d->sofmcu);
+			b->nmcu+=r;
+			b->nsofmcu+=d->sofmcu;
+			if(r!=d->sofmcu) b->nincomplete++;
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+	decoderFree(d);
+	encoderFree(e);
+	return 0;
+}
+
+//process all files of a list file or a directory on nthreads threads
+//return 0 if all the files are ok
+int batchRun(const char* batchin,const char* outdir,int encode,int format,int optimize,int verify,int nthreads){
+	struct batch b;
+	struct stat st;
+	memset(&b,0,sizeof(b));
+	b.outdir=outdir;
+	b.encode=encode;
+	b.format=format;
+	b.optimize=optimize;
+	b.verify=verify;
+	b.dirname=batchin;
+	if(stat(batchin,&st)) b.list=0;
+	else if(S_ISDIR(st.st_mode)) b.dir=opendir(batchin);
+	else b.list=fopen(batchin,"r");
+	if(!b.list&&!b.dir){
+		printf("cannot open %s\n",batchin);
+		return 1;
+	}
+	if(nthreads<1) nthreads=1;
+	pthread_mutex_init(&b.lock,0);
+	pthread_t* th=malloc(nthreads*sizeof(pthread_t));
+	for(int i=0;i<nthreads;i++) pthread_create(th+i,0,batchWorker,&b);
+	for(int i=0;i<nthreads;i++) pthread_join(th[i],0);
+	free(th);
+	pthread_mutex_destroy(&b.lock);
+	if(b.list) fclose(b.list);
+	if(b.dir) closedir(b.dir);
+	if(encode||verify) printf("%d files: %d ok, %d failed\n",b.nfiles,b.nok,b.nfiles-b.nok);
+	else printf("%d files: %d ok (%d with MCU count different from SOF0), %d failed; %lld of %lld MCU\n",b.nfiles,b.nok,b.nincomplete,b.nfiles-b.nok,b.nmcu,b.nsofmcu);
+	return b.nfiles-b.nok>0;
+}
+
+int main (int argc, char **argv) {
+	char filein[2000]="",fileout[2000]="",batchin[2000]="";
+	int offset=0;
+	int decode=0,encode=0,optimize=0,analyze=0,verify=0,nthreads=1,format=FORMAT_TEXT;
+	char heatmap[2000]="",diff[2000]="",base[2000]="",render[2000]="",thumb[2000]="",idxname[2010];
+	int indexstep=0,mcufirst=0,mculast=-1;
+	int region[4]={0,0,0,0},regionpx=0;
+	int c;
 	int option_index=0;
 	struct option long_options[] =
 	{
 		{"decode",       no_argument,   &decode, 1},
 		{"encode",       no_argument,   &encode, 1},
+		{"optimize",     no_argument, &optimize, 1},
+		{"analyze",      no_argument,  &analyze, 1},
+		{"verify",       no_argument,   &verify, 1},
 		{"fin",    required_argument,       0, 'f'},
 		{"fout",   required_argument,       0, 'F'},
+		{"threads",required_argument,       0, 't'},
+		{"batch",  required_argument,       0, 'b'},
+		{"format", required_argument,       0, 'm'},
+		{"heatmap",required_argument,       0, 'h'},
+		{"diff",   required_argument,       0, 'd'},
+		{"index",  required_argument,       0, 'i'},
+		{"mcu-range",required_argument,     0, 'r'},
+		{"region", required_argument,       0, 'R'},
+		{"base",   required_argument,       0, 'B'},
+		{"render", required_argument,       0, 'P'},
+		{"thumb",  required_argument,       0, 'T'},
 		{0, 0, 0, 0}
 	};
 	while ((c = getopt_long_only (argc, argv, "",long_options,&option_index)) != -1)
@@ -601,413 +4225,212 @@ void main (int argc, char **argv) {
 			case 'F':	//fout
 				strncpy(fileout,optarg,sizeof(fileout)-1);
 				break;
+			case 't':	//threads
+				nthreads=atoi(optarg);
+				break;
+			case 'b':	//batch
+				strncpy(batchin,optarg,sizeof(batchin)-1);
+				break;
+			case 'i':	//index
+				indexstep=atoi(optarg);
+				break;
+			case 'r':	//mcu-range
+				if(sscanf(optarg,"%d:%d",&mcufirst,&mculast)!=2||mcufirst<0||mculast<mcufirst){
+					fprintf (stderr,"wrong MCU range %s",optarg);
+					return 1;
+				}
+				break;
+			case 'R':{	//region
+				char px[3]="";
+				int n=sscanf(optarg,"%d,%d,%d,%d%2s",region,region+1,region+2,region+3,px);
+				regionpx=n==5&&!strcmp(px,"px");
+				if(n<4||(n==5&&!regionpx)||region[0]<0||region[1]<0||region[2]<=0||region[3]<=0){
+					fprintf (stderr,"wrong region %s",optarg);
+					return 1;
+				}
+				break;
+			}
+			case 'B':	//base
+				strncpy(base,optarg,sizeof(base)-1);
+				break;
+			case 'P':	//render
+				strncpy(render,optarg,sizeof(render)-1);
+				break;
+			case 'T':	//thumb
+				strncpy(thumb,optarg,sizeof(thumb)-1);
+				break;
+			case 'd':	//diff
+				strncpy(diff,optarg,sizeof(diff)-1);
+				break;
+			case 'h':	//heatmap
+				strncpy(heatmap,optarg,sizeof(heatmap)-1);
+				break;
+			case 'm':	//format
+				if(!strcmp(optarg,"bin")) format=FORMAT_BIN;
+				else if(!strcmp(optarg,"text")) format=FORMAT_TEXT;
+				else{
+					fprintf (stderr,"unknown format %s",optarg);
+					return 1;
+				}
+				break;
 			case '?':
 				fprintf (stderr,"option error");
-				return;
+				return 1;
 			default:
 
 				break;
 		}
-	int bit;
-	if(encode==0&&decode==0){
+	if(analyze){
+		decode=1;
+		format=FORMAT_ANALYZE;
+	}
+	if(render[0]){
+		decode=1;
+		format=FORMAT_RENDER;
+		if(!batchin[0]&&fileout[0]){	//-batch: <file>.ppm in -fout <dir>
+			fprintf (stderr,"-render <file> can't be used with -fout");
+			return 1;
+		}
+		if(!batchin[0]) strcpy(fileout,render);
+	}
+	if(thumb[0]){
+		decode=1;
+		format=FORMAT_THUMB;
+		if(render[0]){
+			fprintf (stderr,"-thumb can't be used with -render");
+			return 1;
+		}
+		if(!batchin[0]&&fileout[0]){	//-batch: <file>.ppm in -fout <dir>
+			fprintf (stderr,"-thumb <file> can't be used with -fout");
+			return 1;
+		}
+		if(!batchin[0]) strcpy(fileout,thumb);
+	}
+	if(encode==0&&decode==0&&verify==0&&diff[0]==0){
 		printf("\
 Usage:\n\
--decode or -encode -fin <file> -fout <file>\n");
-		return;
+-decode or -encode -fin <file> -fout <file> (-fin -: read stdin)\n\
+-threads <N>: decode/encode on N threads\n\
+-format <text|bin>: text (default) or binary coefficient file\n\
+-batch <listfile|dir>: decode/encode all files listed or in dir (.jpg, .txt or .bin)\n\
+ on -threads <N> threads, writing <file>.txt/.bin or <file>.jpg in -fout <dir>\n\
+ or next to the input (-region, -mcu-range, -index, -base, -diff, -heatmap:\n\
+ single file only)\n\
+-optimize: -encode with optimal Huffman tables (text input)\n\
+-analyze: decode to a JSON report of the damaged MCUs, no text (-fout or stdout)\n\
+-heatmap <file>: with -analyze also write a PGM image with a pixel per MCU\n\
+-verify -fin <file>: check the scan data, stopping at the first error;\n\
+ exit code 0 if correct (-batch: a line per file)\n\
+-diff <file> -fin <file>: MCU ranges that differ between two copies of an image\n\
+ (-fout or stdout)\n\
+-index <K>: with -decode also write <file>.idx, with a checkpoint every K MCU\n\
+-mcu-range <a:b>: -decode MCU a to b only, starting from <file>.idx if present\n\
+-region <x,y,w,h>: -decode only the MCU in this rectangle (x,y,w,hpx: in pixels),\n\
+ skipping the others by restart interval or <file>.idx if present\n\
+-base <file>: -encode only the blocks changed from the jpeg the text was decoded\n\
+ from, into a copy of it (faster with <file>.idx)\n\
+-render <file> -fin <file>: reconstruct the image from the decoded coefficients\n\
+ and write it as PPM (-threads <N>: N threads; -batch: <file>.ppm in -fout <dir>)\n\
+-thumb <file> -fin <file>: write a 1/8 scale PPM image from the DC values only\n\
+ (-batch: <file>.ppm in -fout <dir>)\n");
+		return 0;
+	}
+	if(batchin[0]){
+		const char* single=region[2]?"-region":mculast>=0?"-mcu-range":indexstep?"-index":base[0]?"-base":diff[0]?"-diff":heatmap[0]?"-heatmap":0;
+		if(single){		//options of a single file
+			fprintf (stderr,"%s can't be used with -batch",single);
+			return 1;
+		}
+		return batchRun(batchin,fileout,encode,format,optimize,verify,nthreads);
 	}
 	if(!strcmp(filein,fileout)){ 	//in=out
 		printf("fileout=filein");
-		return;
+		return 1;
 	}
-	FILE* f=fopen(filein,"rb");		//input file
-	if(!f) return;
+	FILE* f=strcmp(filein,"-")?fopen(filein,"rb"):stdin;		//input file ("-": stdin)
+	if(!f) return 1;
 	FILE* f2=0;
 	if(fileout[0]){
 		f2=fopen(fileout,"wb");
-		if(!f2) return;
+		if(!f2) return 1;
+	}
+	else if(analyze) f2=stdout;
+	FILE* pgm=0;
+	if(analyze&&heatmap[0]){
+		pgm=fopen(heatmap,"wb");
+		if(!pgm) return 1;
 	}
 	char *buf=malloc(offset);
 	int r=fread(buf,1,offset,f);
-	Rbitcount=offset*8;
 //text file tags
 // <raw>0x  0b  </raw> <y>1 2 3 4  </y> <c> 1 2 3 4 </c>
 // <restart>x<restart>
 //<dht>1 2 3 4 </dht> 
+	if(verify){				//check jpeg
+		long long pos;
+		struct decoder* d=decoderNew();
+		decoderLog(d,0);
+		int r=verifyJpeg(d,f,&pos);
+		decoderFree(d);
+		if(r==VERIFY_OK||r==VERIFY_READ) printf("%s: %s\n",filein,verifymsg[r]);
+		else printf("%s: %s @0x%llX.%d\n",filein,verifymsg[r],pos>>3,(int)(pos&7));
+		exit(r);
+	}
+	if(diff[0]){			//compare two jpeg
+		FILE* f3=fopen(diff,"rb");
+		if(!f3) return 1;
+		struct decoder* d=decoderNew();
+		decoderLog(d,0);
+		int r=diffJpeg(d,f,f3,f2?f2:stdout);
+		if(r<0) printf("cannot read the scan data\n");
+		decoderFree(d);
+		fclose(f3);
+		return r<0;
+	}
+	r=0;
 	if(decode){				//jpeg -> txt
-		int i=0,j,size,dht[]={-1,-1,-1,-1};
-		int X=0,Y=0,Mx=0,My=0;
-		int Nraw=0,Ny=0,Nc=0;
-		printf("Addr     \tMarker\tType\n");
-		for(r=fgetc(f);r!=EOF;r=fgetc(f)){
-			if(r==0xFF){
-				int r2=fgetc(f);
-				if(r2!=0){ 
-					if(restartInt==-1||(restartInt==0&&!(r2>=0xD0&&r2<=0xD7))) printf("@0x%04X \t0xFF%02X\t",i,r2);	//no RSTX
-					for(j=0;j<sizeof(markers)/sizeof(struct marker);j++){
-						if(r2==markers[j].type){
-							if(markers[j].size==1){
-								size=(fgetc(f)<<8)+fgetc(f);
-								printf("%s (%d bytes)\n",markers[j].shortname,size);
-								for(int k=size-2;k;k--) fgetc(f);
-								i+=size;
-							}
-							else if(restartInt==-1||(restartInt==0&&!(r2>=0xD0&&r2<=0xD7))) printf("%s\n",markers[j].shortname);	//no RSTX
-							if(markers[j].type==0xDA) scanoffset=i+2;	//SOS -> start of stream
-							if(markers[j].type==0xD9) endoffset=i;		//EOI -> end of image
-							if(markers[j].type==0xDD&&size==4){			//DRI define restart interval
-								drioffset=i;
-								restartInt=0;		
-							}
-							if(markers[j].type==0xC0) sof0=i-size+4;	//SOF0 P
-							if(markers[j].type==0xC4){
-								int h;
-								for(h=0;h<4&&dht[h]!=-1;h++);
-								dht[h]=i-size+2;				//DHT "Define Huffman Table"
-							}
-							break;
-						}
-					}
-					if(j==sizeof(markers)/sizeof(struct marker)) printf("??\n");
-				}
-				i++;
-			}
-			i++;
-		}
-		if(endoffset==0) endoffset=ftell(f);
-		fflush(stdout);
-		if(f2){
-			if(sof0){		//start of frame
-				MCUdef[0]=0;
-				fseek(f,sof0,0);
-				printf("Precision=%d",fgetc(f));
-				Y=(fgetc(f)<<8)+fgetc(f);
-				X=(fgetc(f)<<8)+fgetc(f);
-				int comp=fgetc(f);
-				int mcuPixX=0,mcuPixY=0;
-				printf(" %dx%d %d components:\n",X,Y,comp);
-				fprintf(f2,"// %dx%d %d components:\n",X,Y,comp);
-				for(;comp;comp--){
-					int id=fgetc(f);
-					int sfact=fgetc(f);
-					int dest=fgetc(f);
-					char type[2]={0,0};
-					if(dest==0) type[0]='Y';
-					if(dest==1) type[0]='C';
-					printf("ID:%d [%02X] Dest:%d\n",id,sfact,dest);
-					fprintf(f2,"//ID:%d [%02X] Dest:%d\n",id,sfact,dest);
-					for(int n=(sfact>>4)*(sfact&0xF);n;n--) strncat(MCUdef,type,sizeof(MCUdef)-1);
-					if((sfact>>4)>mcuPixX) mcuPixX=(sfact>>4);
-					if((sfact&0xF)>mcuPixY) mcuPixY=(sfact&0xF);
-				}
-				mcuPixX*=8;
-				mcuPixY*=8;
-				printf("MCU: %s (%dx%d pixel)\n",MCUdef,mcuPixX,mcuPixY);
-				fprintf(f2,"//MCU: %s (%dx%d pixel)\n",MCUdef,mcuPixX,mcuPixY);
-				Mx=0.5+(float)X/(float)mcuPixX;
-				My=0.5+(float)Y/(float)mcuPixY;
-				printf("[%dx%d=%d MCU]\n",Mx,My,Mx*My);
-				fprintf(f2,"//[%dx%d=%d MCU]\n",Mx,My,Mx*My);
-			}
-			if(drioffset){						//define restart interval
-				fseek(f,drioffset,0);
-				X=(fgetc(f)<<8)+fgetc(f);
-				printf("Restart interval: %d\n",X);
-				fprintf(f2,"//Restart interval: %d\n",X);
-				restartInt=X;
-			}
-			for(int h=0;h<4&&dht[h]!=-1;h++){	//define huffman table
-				fseek(f,dht[h],0);
-				size=(fgetc(f)<<8)+fgetc(f)-2;	//2 bytes less to exclude size
-				uint8_t table[size];
-				fread(table,size,1,f);
-				int (*HTX)[3]=0;
-				if(size==sizeof(HT0)&&!memcmp(table,HT0,size)) printf("standard Huffman table @0x%X\n",dht[h]+2);
-				else if(size==sizeof(HT1)&&!memcmp(table,HT1,size)) printf("standard Huffman table (Y DC) @0x%X\n",dht[h]+2);
-				else if(size==sizeof(HT2)&&!memcmp(table,HT2,size)) printf("standard Huffman table (Y AC) @0x%X\n",dht[h]+2);
-				else if(size==sizeof(HT3)&&!memcmp(table,HT3,size)) printf("standard Huffman table (C DC) @0x%X\n",dht[h]+2);
-				else if(size==sizeof(HT4)&&!memcmp(table,HT4,size)) printf("standard Huffman table (C AC) @0x%X\n",dht[h]+2);
-				else{
-					//printf("DHT: %dB\n",size);
-					int huffsize[256];
-					int fullcode[256];
-					for(int z=0;z<size;){
-						//printf("Dest: %d %s\n",table[z]&0xF,(table[z]>>4)?"AC":"DC");
-						if((table[z]&0xF)==0&&(table[z]>>4)==0) HTX=YDC;
-						else if((table[z]&0xF)==0&&(table[z]>>4)==1) HTX=YAC;
-						else if((table[z]&0xF)==1&&(table[z]>>4)==0) HTX=CDC;
-						else if((table[z]&0xF)==1&&(table[z]>>4)==1) HTX=CAC;
-						//printf("%p %p %p %p %p\n",HTX,YDC,YAC,CDC,CAC);
-						int k=17,j,ncode=0;
-						for(j=0;j<256;j++) huffsize[j]=0;
-						for(int i=0;i<16;i++){
-							for(j=0;j<table[z+1+i];j++){
-								huffsize[k-17+j]=i+1;
-								fullcode[k-17+j]=table[z+k+j];
-								ncode++;
-							}
-							k+=j;
-						}
-						z+=k;
-						//if(z>29) continue;
-						//ISO/IEC 10918-1 : 1993(E) Figure C.2 – Generation of table of Huffman codes
-						k=0;
-						int code=0;
-						int si=huffsize[0];
-						int huffcode[256];
-						do{
-							do{
-								huffcode[k]=code;
-								code++;
-								k++;
-							} while (huffsize[k]==si);
-							if(huffsize[k]==0) break;
-							do{
-								code<<=1;
-								si++;
-							} while (huffsize[k]!=si);
-						} while (huffsize[k]);
-						//end C.2
-						//printf("[#bit,prefix,code]\n");
-						for(int i=0;i<ncode;i++){
-							//printf("%d,%X,%X\n",huffsize[i],huffcode[i],fullcode[i]);
-							HTX[i][0]=huffsize[i];
-							HTX[i][1]=huffcode[i];
-							HTX[i][2]=fullcode[i];
-						}
-						HTX[ncode][0]=-1;
-						HTX[ncode][1]=-1;
-						HTX[ncode][2]=-1;
-					}
-					fprintf(f2,"<dht>\n");
-					if(HTX==YDC) fprintf(f2,"YDC ");
-					else if(HTX==YAC) fprintf(f2,"YAC ");
-					else if(HTX==CDC) fprintf(f2,"CDC ");
-					else if(HTX==CAC) fprintf(f2,"CAC ");
-					if(HTX) for(int i=0;HTX[i][0]!=-1;i++) fprintf(f2,"[%X %X %X]",HTX[i][0],HTX[i][1],HTX[i][2]);
-					fprintf(f2,"\n</dht>\n");
-				}
-			}
-			fseek(f,0,0);
-			if(scanoffset){	//copy first data as raw
-				fprintf(f2,"<raw>");
-				for(int p=0;p<scanoffset;p++){
-					if(p%32==0) fprintf(f2,"\n0x");
-					fprintf(f2,"%02X",fgetc(f));
-				}
-				fprintf(f2,"\n</raw>");
-				fflush(stdout);
-			}
-			Rbitcount=scanoffset*8;
-			int mcucount=0,decode_result,restartCount=0;
-			int rstErrStat[50],rstErrStat_extra=0,errnum,next_rstnum=0,rst;
-			int iblock=0;
-			for(int i=0;i<50;i++) rstErrStat[i]=0;
-			for(;Rbitcount<endoffset*8-16;){	//decode MCU (-2 bytes to end at last MCU)
-				if(iblock==0) fprintf(f2,"\n//************ MCU %d (%d,%d) (@0x%X.%d):",mcucount,mcucount%Mx,mcucount/Mx,Rbitcount>>3,Rbitcount&7);
-				if(MCUdef[iblock]=='Y')	decode_result=decodeBlock(f,f2,2,Y_BLOCK);
-				else if(MCUdef[iblock]=='C')	decode_result=decodeBlock(f,f2,2,C_BLOCK);
-				rst=decode_result>>8;
-				if((decode_result&0xF)==DECODE_PARTIAL_RESTART){
-					if(MCUdef[iblock]=='Y') Ny++;
-					if(MCUdef[iblock]=='C') Nc++;
-					iblock++;
-				}					
-				if((decode_result&0xF)==DECODE_RESTART||(decode_result&0xF)==DECODE_PARTIAL_RESTART){
-					if(restartCount<restartInt){
-						if(iblock<strlen(MCUdef)) fprintf(f2,"\n//Restart interval error (%d: %d MCU instead of %d)",restartCount-restartInt,restartCount,restartInt);
-					}
-					restartCount=0;
-					if(iblock>0){
-						mcucount++;
-						if(iblock<strlen(MCUdef)) fprintf(f2,"\n//MCU error: missing component  (%d instead of %d)",iblock,strlen(MCUdef));
-						iblock=0;
-					}
-					if(rst!=next_rstnum){
-						fprintf(f2,"\n//Restart marker # error (%d instead of %d)",rst,next_rstnum);
-					}
-					next_rstnum=rst+1;
-					if(next_rstnum>7) next_rstnum=0;
-				}
-				else if((decode_result&0xF)==DECODE_OK||(decode_result&0xF)==DECODE_ERR){
-					if(restartInt>0&&iblock==0){	//on new MCU only
-						restartCount++;
-						errnum=restartCount-restartInt;
-						if(errnum>0){
-							fprintf(f2,"\n//Restart interval error (+%d: %d MCU instead of %d)",errnum,restartCount,restartInt);
-							if(errnum<50) rstErrStat[errnum]++;
-							else rstErrStat_extra=1;
-						}
-					}
-					if(MCUdef[iblock]=='Y') Ny++;
-					if(MCUdef[iblock]=='C') Nc++;
-					iblock++;
-					if(iblock>=strlen(MCUdef)){
-						iblock=0;
-						mcucount++;
-					}					
-				}
-				else if(decode_result==DECODE_EOI);
-				else{
-					printf("MCU decoding error (0x%X)\n",decode_result);
-					//break;
-				}					
-			}
-			fprintf(f2,"\n<EOI></EOI>\n");
-			printf("found %d MCU (%d Y + %d C)\n",mcucount,Ny,Nc);
-			fprintf(f2,"//found %d MCU (%d Y + %d C)\n",mcucount,Ny,Nc);
-			if(restartInt>0){
-				int e=0;
-				//convert to absolute chains
-				for(int i=49;i>0;i--){
-					for(int j=i-1;rstErrStat[i]&&j>0;j--){
-						rstErrStat[j]-=rstErrStat[i];
-					}
-					if(rstErrStat[i]) e=1;
-				}
-				if(e){
-					printf("Missing restart markers\nL \t#\n");
-					for(int i=1;i<50;i++){
-						if(rstErrStat[i]) printf("%d\t%d\n",i,rstErrStat[i]);
-					}
-					if(rstErrStat_extra) printf(">49\t>0\n");
-				}
-			}
+		struct decoder* d=decoderNew();
+		if(!d) return 1;
+		FILE* idx=0;
+		snprintf(idxname,sizeof(idxname),"%s.idx",filein);
+		if(indexstep>0&&mculast<0&&region[2]==0&&strcmp(filein,"-")){
+			idx=fopen(idxname,"wb");
+			decoderIndex(d,idx,indexstep);
+		}
+		if(mculast>=0){
+			if(strcmp(filein,"-")) idx=fopen(idxname,"rb");
+			decoderRange(d,mcufirst,mculast,idx);
 		}
+		else if(region[2]>0){
+			if(strcmp(filein,"-")) idx=fopen(idxname,"rb");
+			decoderRegion(d,region[0],region[1],region[2],region[3],regionpx,idx);
+		}
+		decoderFormat(d,format);
+		if(analyze&&!fileout[0]) decoderLog(d,0);	//JSON on stdout
+		decoderHeatmap(d,pgm);
+		r=decodeJpeg(d,f,f2,nthreads);
+		decoderFree(d);
+		if(pgm) fclose(pgm);
+		if(idx) fclose(idx);
 	}
 	else if(encode&&f&&f2){			//text -> jpeg
-		int tagstart,tagend;
-		int Nraw=0,Ny=0,Nc=0;
-		char tagbuf[128];
-		#define tsize sizeof(tagbuf)
-		int YAC_EOB_I=-1,CAC_EOB_I=-1;
-		for(int i=0;YAC_EOB_I==-1&&YAC[i][2]!=-1;i++) if(YAC[i][2]==0) YAC_EOB_I=i;		//EOB code
-		for(int i=0;CAC_EOB_I==-1&&CAC[i][2]!=-1;i++) if(CAC[i][2]==0) CAC_EOB_I=i;		//EOB code
-		if(YAC_EOB_I==-1||CAC_EOB_I==-1) return; 
-		//printf("Y eob: %d %X %X\n",YAC[YAC_EOB_I][0],YAC[YAC_EOB_I][1],YAC[YAC_EOB_I][2]);
-		//printf("Y zrl: %d %X %X\n",YAC[YAC_ZRL_I][0],YAC[YAC_ZRL_I][1],YAC[YAC_ZRL_I][2]);
-		putbit(0,0);	//reset bit count
-		tagstart=tag(f,tagbuf,tsize);
-		for(;tagstart>=0;tagstart=tag(f,tagbuf,tsize)){
-			//printf("%d: tag= %s\n",tagstart,tagbuf);
-			if(!strcmp(tagbuf,"raw")){		//<raw>
-				tagend=tag(f,tagbuf,tsize);
-				if(tagend&&!strcmp(tagbuf,"/raw")){
-					Nraw++;
-					//printf("R %d: tag= %s\n",tagend,tagbuf);
-					int taglen=tagend-tagstart-5;
-					fseek(f,tagstart+5,0);
-					char* inbuf=malloc(taglen+1);
-					fread(inbuf,taglen,1,f);
-					inbuf[taglen]=0;
-					//printf("R-->%s<--\n",inbuf);
-					int n=parseRaw(inbuf,f2);
-					//printf("Raw: %d byte\n",n/8);
-					free(inbuf);
-					fseek(f,tagend+5,0);
-				}
-			}
-			else if(!strcmp(tagbuf,"y")){		//<y>
-				tagend=tag(f,tagbuf,tsize);
-				if(tagend&&!strcmp(tagbuf,"/y")){
-					Ny++;
-					//printf("Y %d: tag= %s\n",tagend,tagbuf);
-					int taglen=tagend-tagstart-3;
-					fseek(f,tagstart+3,0);
-					char* inbuf=malloc(taglen+1);
-					fread(inbuf,taglen,1,f);
-					inbuf[taglen]=0;
-					//printf("Y-->%s<--\n",inbuf);
-					char* p=parseDC(inbuf,YDC,f2);
-					int n=parseRaw(p,f2);
-					//printf("p%p AC: %d bit\n",p,n);
-					if(n==0){	//no AC data: EOB code
-						//printf("%d Y EOB %d bit %X\n",Ny,YAC[YAC_EOB_I][0],YAC[YAC_EOB_I][1]);
-						if(YAC_EOB_I!=-1) for(int j=1<<(YAC[YAC_EOB_I][0]-1);j;j>>=1) putbit(YAC[YAC_EOB_I][1]&j?1:0,f2);
-					}
-					free(inbuf);
-					fseek(f,tagend+2,0);
-				}
-			}
-			else if(!strcmp(tagbuf,"c")){		//<c>
-				tagend=tag(f,tagbuf,tsize);
-				if(tagend&&!strcmp(tagbuf,"/c")){
-					Nc++;
-					//printf("C %d: tag= %s\n",tagend,tagbuf);
-					int taglen=tagend-tagstart-3;
-					fseek(f,tagstart+3,0);
-					char* inbuf=malloc(taglen+1);
-					fread(inbuf,taglen,1,f);
-					inbuf[taglen]=0;
-					//printf("C-->%s<--\n",inbuf);
-					char* p=parseDC(inbuf,CDC,f2);
-					int n=parseRaw(p,f2);
-					//printf(" AC: %d bit\n",n);
-					if(n==0){	//no AC data: EOB code
-						for(int j=1<<(CAC[CAC_EOB_I][0]-1);j;j>>=1) putbit(CAC[CAC_EOB_I][1]&j?1:0,f2);
-					}
-					free(inbuf);
-					fseek(f,tagend+2,0);
-				}
-			}
-			else if(!strcmp(tagbuf,"restart")){		//<restart>
-				tagend=tag(f,tagbuf,tsize);
-				int len=strlen(tagbuf);
-				if(tagend&&!strcmp(tagbuf,"/restart")){
-					int taglen=tagend-tagstart-len-1;
-					fseek(f,tagstart+len+1,0);
-					char* inbuf=malloc(taglen+1);
-					fread(inbuf,taglen,1,f);
-					inbuf[taglen]=0;
-					int res_marker=0;
-					sscanf(inbuf,"%d",&res_marker);
-					putbit(-1,f2);	//fill byte
-					fputc(0xFF,f2);
-					fputc(0xD0+res_marker,f2);					
-					free(inbuf);
-					fseek(f,tagend+len+2,0);
-				}
-			}
-			else if(!strcmp(tagbuf,"dht")){		//<dht> </dht> len=3
-				tagend=tag(f,tagbuf,tsize);
-				int len=strlen(tagbuf);
-				if(tagend&&!strcmp(tagbuf,"/dht")){
-					int taglen=tagend-tagstart-len-1;
-					fseek(f,tagstart+len+1,0);
-					char* inbuf=malloc(taglen+1);
-					fread(inbuf,taglen,1,f);
-					inbuf[taglen]=0;
-					char* ht[128];
-					int (*HTX)[3]=0;
-					sscanf(inbuf,"%s",ht);
-					if(!strcmp(ht,"YDC")) HTX=YDC; 
-					if(!strcmp(ht,"YAC")) HTX=YAC;
-					if(!strcmp(ht,"CDC")) HTX=CDC;
-					if(!strcmp(ht,"CAC")) HTX=CAC;
-					char *p;
-					int x,y,z,j=0;
-					for(p=strtok(inbuf,"[]");p!=NULL;p=strtok(NULL,"[]")){
-						if(sscanf(p,"%x %x %x",&x,&y,&z)==3){
-							//printf("[%X %X %X]",x,y,z);
-							HTX[j][0]=x;
-							HTX[j][1]=y;
-							HTX[j][2]=z;
-							j++;
-						}
-					}
-					HTX[j][0]=-1;
-					HTX[j][1]=-1;
-					HTX[j][2]=-1;
-					//printf("\n");
-					free(inbuf);
-					fseek(f,tagend+len+2,0);
-				}
-			}
+		struct encoder* e=encoderNew();
+		if(!e) return 1;
+		encoderFormat(e,format);
+		encoderOptimize(e,optimize);
+		FILE* fb=0,*idx=0;
+		if(base[0]){
+			fb=fopen(base,"rb");
+			if(!fb) return 1;
+			snprintf(idxname,sizeof(idxname),"%s.idx",base);
+			idx=fopen(idxname,"rb");
+			encoderBase(e,fb,idx);
 		}
-		putbit(-1,f2);	//fill byte with 1 and write to file
-		fputc(0xFF,f2);
-		fputc(0xD9,f2);
-		printf("%d raw segments\n%d y segments\n%d c segments",Nraw,Ny,Nc);
+		r=encodeJpeg(e,f,f2,nthreads);
+		encoderFree(e);
+		if(fb) fclose(fb);
+		if(idx) fclose(idx);
 	}
-	return;
+	return r<0;
 }
-
+#endif
@@ -0,0 +1,94 @@
+/*
+ * jpeg-decomp.h - library interface of jpeg-decomp
+ * Copyright (C) 2022 Alberto Maccioni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef JPEG_DECOMP_H
+#define JPEG_DECOMP_H
+
+#include <stdio.h>
+
+//decoder and encoder contexts hold all the state of one image (tables, MCU
+//composition, restart interval, reader/writer state): images with different
+//contexts can be processed at the same time by different threads
+
+struct decoder;
+struct encoder;
+
+//text format or binary coefficient container
+#define FORMAT_TEXT 0
+#define FORMAT_BIN 1
+//decoder only: JSON report of the damaged MCUs, without text
+#define FORMAT_ANALYZE 2
+//decoder only: PPM image reconstructed from the coefficients (baseline, 1 or 3 components)
+#define FORMAT_RENDER 6
+//decoder only: the same at 1/8 scale (a pixel per block), decoding only the DC values
+#define FORMAT_THUMB 7
+
+struct decoder* decoderNew();
+void decoderFree(struct decoder* d);
+//messages go to log (default stdout, 0: none)
+void decoderLog(struct decoder* d,FILE* log);
+//output format (default FORMAT_TEXT)
+void decoderFormat(struct decoder* d,int format);
+//with FORMAT_ANALYZE also write a PGM heatmap with a pixel per MCU to pgm (0: none)
+void decoderHeatmap(struct decoder* d,FILE* pgm);
+//write to idx a sidecar index of the scan while decoding, with a checkpoint
+//(bit address, DC predictors, restart state) every step MCUs (idx=0: none)
+void decoderIndex(struct decoder* d,FILE* idx,int step);
+//decode only MCUs first to last (last<0: all), starting from the nearest
+//checkpoint of the index idx of the same file (0 or other file: from the start)
+void decoderRange(struct decoder* d,int first,int last,FILE* idx);
+//text only: decode only the MCUs in the rectangle x,y,w,h (in MCU, or in pixels if
+//pixels=1), a run per row with its bit range to splice it back into the scan; the
+//other MCUs are skipped using restart intervals or the index idx where possible;
+//decodeJpeg returns -1 if the rectangle is outside the image
+void decoderRegion(struct decoder* d,int x,int y,int w,int h,int pixels,FILE* idx);
+//decode jpeg file f to text file or binary container f2 (f2=0: list markers only)
+//using nthreads threads;
+//a context can decode several files one after the other
+//return the number of MCU found or -1 on error
+int decodeJpeg(struct decoder* d,FILE* f,FILE* f2,int nthreads);
+
+//verifyJpeg results
+#define VERIFY_OK 0
+#define VERIFY_READ 1		//can't read the file, or no SOF0 or SOS segment
+#define VERIFY_HUFFMAN 2	//no Huffman code, or DC/AC size out of range
+#define VERIFY_COEFF 3		//more than 63 AC coefficients in a block
+#define VERIFY_RESTART 4	//restart marker # or restart interval error
+#define VERIFY_MCUCOUNT 5	//MCU count different from the SOF0 size
+//check the entropy coded data of jpeg file f without any output, stopping at
+//the first structural error; the bit address of the error goes in *errpos
+//(errpos=0: not needed)
+//return VERIFY_xxx
+int verifyJpeg(struct decoder* d,FILE* f,long long* errpos);
+
+//compare the scan data of jpeg files f and other (two copies of an image) and write
+//to out the ranges of MCUs that differ, with their x,y positions
+//return the number of ranges or -1 on error
+int diffJpeg(struct decoder* d,FILE* f,FILE* other,FILE* out);
+
+//return 0 if the default tables have no EOB code
+struct encoder* encoderNew();
+void encoderFree(struct encoder* e);
+void encoderLog(struct encoder* e,FILE* log);
+//input format (default FORMAT_TEXT)
+void encoderFormat(struct encoder* e,int format);
+//optimize=1: re-code the blocks of a text with optimal Huffman tables, written
+//in place of the DHT segments of its header (default 0)
+void encoderOptimize(struct encoder* e,int optimize);
+//text only: copy jpeg file base (the one the text was decoded from, as a whole or in
+//part: -mcu-range, -region) re-encoding only the blocks of the text that differ from it;
+//idx: index of base (decoderIndex) to find MCU starts faster (0: none)
+//(base=0: encode the whole text, default)
+void encoderBase(struct encoder* e,FILE* base,FILE* idx);
+//encode text file or binary container f to jpeg file f2 using nthreads threads
+//return 0 or -1 on error
+int encodeJpeg(struct encoder* e,FILE* f,FILE* f2,int nthreads);
+
+#endif